@@ -1,5 +1,9 @@
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
+#include <vector>
 #include "msgpack-alt.hpp"
 #include "variant.hpp"
 
@@ -13,6 +17,509 @@ Variant getVariant() {
 }
 
 
+// compare the compact encoding with the reference bytes of the msgpack spec
+bool checkEncoding(const Variant& v, const std::string& expected) {
+    const std::string actual = MsgPack(v).packer();
+    if (actual != expected) {
+        std::cerr << "NG: " << v.str() << std::endl;
+        return false;
+    }
+    if (MsgPack(v).encodedSize() != expected.size()) {
+        std::cerr << "NG (size): " << v.str() << std::endl;
+        return false;
+    }
+
+    MsgPack decoded;
+    decoded.unpacker(actual);
+    if (decoded.packer() != expected) {
+        std::cerr << "NG (round trip): " << v.str() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+bool checkCompactEncodings() {
+    bool ans = true;
+    const std::string s31(31, 'a');
+    const std::string s32(32, 'a');
+    const std::string s256(256, 'a');
+
+    ans &= checkEncoding(Variant(), std::string("\xc0", 1));
+    ans &= checkEncoding(false, std::string("\xc2", 1));
+    ans &= checkEncoding(true, std::string("\xc3", 1));
+
+    ans &= checkEncoding(0, std::string("\x00", 1));
+    ans &= checkEncoding(127, std::string("\x7f", 1));
+    ans &= checkEncoding(128, std::string("\xcc\x80", 2));
+    ans &= checkEncoding(255, std::string("\xcc\xff", 2));
+    ans &= checkEncoding(256, std::string("\xcd\x01\x00", 3));
+    ans &= checkEncoding(65535, std::string("\xcd\xff\xff", 3));
+    ans &= checkEncoding(65536, std::string("\xce\x00\x01\x00\x00", 5));
+    ans &= checkEncoding(4294967296L, std::string("\xcf\x00\x00\x00\x01\x00\x00\x00\x00", 9));
+
+    ans &= checkEncoding(-1, std::string("\xff", 1));
+    ans &= checkEncoding(-32, std::string("\xe0", 1));
+    ans &= checkEncoding(-33, std::string("\xd0\xdf", 2));
+    ans &= checkEncoding(-128, std::string("\xd0\x80", 2));
+    ans &= checkEncoding(-129, std::string("\xd1\xff\x7f", 3));
+    ans &= checkEncoding(-32768, std::string("\xd1\x80\x00", 3));
+    ans &= checkEncoding(-32769, std::string("\xd2\xff\xff\x7f\xff", 5));
+    ans &= checkEncoding(-2147483649L, std::string("\xd3\xff\xff\xff\xff\x7f\xff\xff\xff", 9));
+
+    ans &= checkEncoding(1.5, std::string("\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00", 9));
+
+    ans &= checkEncoding("", std::string("\xa0", 1));
+    ans &= checkEncoding("hello", std::string("\xa5hello", 6));
+    ans &= checkEncoding(s31, "\xbf" + s31);
+    ans &= checkEncoding(s32, "\xd9\x20" + s32);
+    ans &= checkEncoding(s256, std::string("\xda\x01\x00", 3) + s256);
+
+    Variant array(Variant::ARRAY);
+    array.push_back(1);
+    array.push_back(2);
+    array.push_back(3);
+    ans &= checkEncoding(array, std::string("\x93\x01\x02\x03", 4));
+
+    Variant array16(Variant::ARRAY);
+    for (int i = 0; i < 16; ++i) {
+        array16.push_back(0);
+    }
+    ans &= checkEncoding(array16, std::string("\xdc\x00\x10", 3) + std::string(16, '\0'));
+
+    Variant map;
+    map["a"] = 1;
+    ans &= checkEncoding(map, std::string("\x81\xa1\x61\x01", 4));
+
+    Variant bin;
+    bin.set_binary("\x01\x02", 2);
+    ans &= checkEncoding(bin, std::string("\xc4\x02\x01\x02", 4));
+
+    Variant fixext;
+    fixext.set_ext(5, "abcd", 4);
+    ans &= checkEncoding(fixext, std::string("\xd6\x05" "abcd", 6));
+
+    Variant ext;
+    ext.set_ext(5, "abc", 3);
+    ans &= checkEncoding(ext, std::string("\xc7\x03\x05" "abc", 6));
+
+    Variant timestamp32;
+    timestamp32.set_timestamp(1);
+    ans &= checkEncoding(timestamp32, std::string("\xd6\xff\x00\x00\x00\x01", 6));
+
+    Variant timestamp64;
+    timestamp64.set_timestamp(1, 1);
+    ans &= checkEncoding(timestamp64, std::string("\xd7\xff\x00\x00\x00\x04\x00\x00\x00\x01", 10));
+
+    Variant timestamp96;
+    timestamp96.set_timestamp(-1, 1);
+    ans &= checkEncoding(timestamp96, std::string("\xc7\x0c\xff\x00\x00\x00\x01", 7) + std::string(8, '\xff'));
+
+    // every integer getter reads the seconds of a timestamp
+    if ((timestamp64.get_int() != 1) || (timestamp64.get_uint() != 1) ||
+        (timestamp64.get_long() != 1) || (timestamp64.get_ulong() != 1)) {
+        std::cerr << "NG (timestamp getters): " << timestamp64.str() << std::endl;
+        ans = false;
+    }
+
+    return ans;
+}
+
+
+// the writer must produce the same bytes as packing the equivalent Variant
+bool checkWriter() {
+    Variant v;
+    v["id"] = 300;
+    v["name"] = "abc";
+    v["values"].push_back(-1);
+    v["values"].push_back(1.5);
+    v["values"].push_back(Variant());
+
+    MsgPackWriter writer;
+    for (int i = 0; i < 2; ++i) {
+        writer.clear();
+        writer.pack_map_header(3);
+        writer.pack_str("id");
+        writer.pack_int(300);
+        writer.pack_str("name");
+        writer.pack_str("abc", 3);
+        writer.pack_str("values");
+        writer.pack_array_header(3);
+        writer.pack_int(-1);
+        writer.pack_double(1.5);
+        writer.pack_nil();
+
+        if (writer.str() != MsgPack(v).packer()) {
+            std::cerr << "NG (writer): " << v.str() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// sorting must leave a usable index for maps larger than the initial table
+bool checkSortKeys() {
+    Variant map;
+    for (int i = 19; i >= 0; --i) {
+        map[std::string("key") + std::to_string(i)] = i;
+    }
+    map.erase(Variant("key7"));
+    map.sort_keys();
+
+    if ((map.has_key("nope") == true) || (map.has_key("key7") == true) ||
+        (map.has_key("key3") != true) || (map["key19"].get_int() != 19)) {
+        std::cerr << "NG (sort_keys): " << map.str() << std::endl;
+        return false;
+    }
+    if ((*map.beginMap()).first.get_str() != "key0") {
+        std::cerr << "NG (sort_keys order): " << map.str() << std::endl;
+        return false;
+    }
+
+    // the order must not depend on the insertion order, like operator==
+    Variant a;
+    a["a"] = 1;
+    a["b"] = 2;
+    Variant b;
+    b["b"] = 2;
+    b["a"] = 1;
+    Variant c;
+    c["a"] = 1;
+    c["b"] = 3;
+    if ((a != b) || (a < b) || (b < a) || ((a < c) != true) || ((b < c) != true) || (c < b)) {
+        std::cerr << "NG (map order): " << a.str() << " " << b.str() << " " << c.str() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// an index below the first level covers many containers and must build quickly
+bool checkIndex() {
+    Variant records(Variant::ARRAY);
+    for (int i = 0; i < 20000; ++i) {
+        Variant record;
+        record["id"] = i;
+        record["name"] = std::string("name") + std::to_string(i);
+        record["tags"].push_back("a");
+        records.push_back(record);
+    }
+    const std::string data = MsgPack(records).packer();
+
+    MsgPackIndex index;
+    Variant value;
+    if ((index.build(data.data(), data.size(), 2) != true) || (index.size() != 1 + 20000 * 4) ||
+        (index.get(data.data(), data.size(), "19999/name", value) != true) ||
+        (value.get_str() != "name19999")) {
+        std::cerr << "NG (index)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// a few objects of different kinds, concatenated as a stream
+std::vector<Variant> getStreamObjects() {
+    std::vector<Variant> objects;
+    objects.push_back(getVariant());
+    objects.push_back(Variant(std::string(40, 's')));
+    objects.push_back(Variant(-70000));
+
+    Variant nested(Variant::ARRAY);
+    nested.push_back(Variant(Variant::MAP));
+    nested.push_back(1.5);
+    nested.getAt(0)["list"].push_back(4294967296L);
+    objects.push_back(nested);
+    return objects;
+}
+
+
+// the streaming decoder must not depend on where the input is split
+bool checkDecoder() {
+    std::string stream;
+    std::vector<Variant> expected;
+    const std::vector<Variant> objects = getStreamObjects();
+    for (std::size_t i = 0; i < objects.size(); ++i) {
+        const std::string data = MsgPack(objects[i]).packer();
+        MsgPack msgpack;
+        msgpack.unpack(data.data(), data.size());
+        expected.push_back(msgpack.getVariant());
+        stream += data;
+    }
+
+    for (std::size_t split = 0; split <= stream.size(); ++split) {
+        MsgPackDecoder decoder;
+        std::vector<Variant> decoded;
+        Variant value;
+        bool good = decoder.feed(stream.data(), split);
+        while (decoder.next(value) == true) {
+            decoded.push_back(value);
+        }
+        good &= decoder.feed(stream.data() + split, stream.size() - split);
+        while (decoder.next(value) == true) {
+            decoded.push_back(value);
+        }
+
+        if ((good != true) || (decoder.pending() != 0) || (decoded != expected)) {
+            std::cerr << "NG (decoder): split at " << split << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// read every object, and tell a clean end from a truncated tail
+bool readStream(MsgPackReader& reader, std::vector<Variant>& objects) {
+    Variant value;
+    while (reader.next(value) == true) {
+        objects.push_back(value);
+    }
+    return reader.good();
+}
+
+
+// objects appended to a file must read back the same from the file and from memory
+bool checkAppendAndRead() {
+    const char* path = "test_stream.mpac";
+    const std::vector<Variant> objects = getStreamObjects();
+    std::vector<Variant> expected;
+    std::remove(path);
+
+    // enough objects that the file is read in several chunks
+    const int repeat = 2000;
+    MsgPackAppender appender;
+    appender.open(path);
+    for (int n = 0; n < repeat; ++n) {
+        for (std::size_t i = 0; i < objects.size(); ++i) {
+            appender.append(objects[i]);
+        }
+    }
+    appender.close();
+
+    MsgPackReader reader;
+    reader.open(path);
+    const bool fileGood = readStream(reader, expected);
+
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    std::vector<Variant> fromMemory;
+    reader.open(data.data(), data.size());
+    const bool memoryGood = readStream(reader, fromMemory);
+
+    if ((fileGood != true) || (memoryGood != true) || (expected.size() != repeat * objects.size()) ||
+        (fromMemory != expected)) {
+        std::cerr << "NG (append and read)" << std::endl;
+        return false;
+    }
+
+    // a truncated last object ends the stream with an error in both modes
+    std::ofstream ofs(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    ofs.write(data.data(), data.size() - 1);
+    ofs.close();
+
+    std::vector<Variant> truncatedFile;
+    reader.open(path);
+    const bool truncatedFileGood = readStream(reader, truncatedFile);
+    std::vector<Variant> truncatedMemory;
+    reader.open(data.data(), data.size() - 1);
+    const bool truncatedMemoryGood = readStream(reader, truncatedMemory);
+
+    expected.pop_back();
+    if ((truncatedFileGood == true) || (truncatedMemoryGood == true) ||
+        (truncatedFile != expected) || (truncatedMemory != expected)) {
+        std::cerr << "NG (append and read, truncated)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// decoding on several threads must give the same result as unpack
+bool checkParallelUnpack() {
+    const std::vector<Variant> objects = getStreamObjects();
+    Variant records(Variant::ARRAY);
+    std::string stream;
+    for (int n = 0; n < 5000; ++n) {
+        records.push_back(objects[n % objects.size()]);
+        stream += MsgPack(objects[n % objects.size()]).packer();
+    }
+    const std::string data = MsgPack(records).packer();
+
+    // the stream holds the same objects as the array, so both decode alike
+    MsgPack serial;
+    serial.unpack(data.data(), data.size());
+
+    for (unsigned int threads = 1; threads <= 4; ++threads) {
+        MsgPack parallel;
+        MsgPack parallelStream;
+        if ((parallel.unpackParallel(data.data(), data.size(), threads) != true) ||
+            (parallel.getVariant() != serial.getVariant()) ||
+            (parallelStream.unpackStreamParallel(stream.data(), stream.size(), threads) != true) ||
+            (parallelStream.getVariant() != serial.getVariant())) {
+            std::cerr << "NG (parallel unpack): threads=" << threads << std::endl;
+            return false;
+        }
+    }
+
+    // a truncated array fails like the serial decoder
+    MsgPack truncated;
+    if (truncated.unpackParallel(data.data(), data.size() - 1, 4) == true) {
+        std::cerr << "NG (parallel unpack, truncated)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// encoding on several threads must give exactly the bytes of packer()
+bool checkParallelPack() {
+    const std::vector<Variant> objects = getStreamObjects();
+    Variant records(Variant::ARRAY);
+    Variant table;
+    for (int n = 0; n < 5000; ++n) {
+        records.push_back(objects[n % objects.size()]);
+        table[std::string("key") + std::to_string(n)] = objects[n % objects.size()];
+    }
+    table.erase(Variant("key10"));
+
+    const Variant values[] = { records, table, Variant(1), Variant(Variant::ARRAY) };
+    for (std::size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        for (int compact = 0; compact < 2; ++compact) {
+            MsgPack msgpack(values[i]);
+            msgpack.setCompact(compact != 0);
+            const std::string expected = msgpack.packer();
+            for (unsigned int threads = 1; threads <= 4; ++threads) {
+                std::vector<std::string> pieces;
+                msgpack.packerParallel(pieces, threads);
+                std::string joined;
+                for (std::size_t j = 0; j < pieces.size(); ++j) {
+                    joined += pieces[j];
+                }
+                if ((msgpack.packerParallel(threads) != expected) || (joined != expected)) {
+                    std::cerr << "NG (parallel pack): threads=" << threads << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+
+// decode only the parts of data selected by paths
+Variant unpackSelected(const std::string& data, const std::vector<std::string>& paths) {
+    MsgPack msgpack;
+    if (msgpack.unpackSelected(data.data(), data.size(), paths) != true) {
+        return Variant();
+    }
+    return msgpack.getVariant();
+}
+
+
+// selective decoding must keep only the selected parts at their places
+bool checkSelected() {
+    Variant v = getVariant();
+    for (int i = 0; i < 12; ++i) {
+        Variant item;
+        item["id"] = i;
+        item["name"] = std::string("item") + std::to_string(i);
+        v["items"].push_back(item);
+    }
+    const std::string data = MsgPack(v).packer();
+
+    // nested keys
+    Variant expected;
+    expected["group1"]["subgroup1"] = "value1-1";
+    bool ans = (unpackSelected(data, std::vector<std::string>(1, "group1/subgroup1")) == expected);
+
+    // array indices keep their positions; "010" is not an index
+    std::vector<std::string> paths;
+    paths.push_back("items/1/id");
+    paths.push_back("items/10/name");
+    paths.push_back("items/010/name");
+    Variant selected = unpackSelected(data, paths);
+    ans &= ((selected["items"].size() == 11) &&
+            (selected["items"].getAt(0).type() == Variant::NONE) &&
+            (selected["items"].getAt(1)["id"].get_int() == 1) &&
+            (selected["items"].getAt(1).has_key("name") != true) &&
+            (selected["items"].getAt(10)["name"].get_str() == "item10"));
+
+    // missing paths select nothing
+    paths.assign(1, "group1/nope");
+    paths.push_back("items/12");
+    ans &= (unpackSelected(data, paths).type() == Variant::NONE);
+
+    // overlapping paths: the whole subtree wins over a part of it
+    paths.assign(1, "items/*/name");
+    paths.push_back("items/2");
+    paths.push_back("key1");
+    selected = unpackSelected(data, paths);
+    ans &= ((selected["key1"].get_str() == "value1") && (selected.has_key("group1") != true) &&
+            (selected["items"].size() == 12) &&
+            (selected["items"].getAt(2) == v["items"].getAt(2)) &&
+            (selected["items"].getAt(3).has_key("id") != true) &&
+            (selected["items"].getAt(3)["name"].get_str() == "item3"));
+
+    if (ans != true) {
+        std::cerr << "NG (selected)" << std::endl;
+    }
+    return ans;
+}
+
+
+// the skip scan must measure valid data and locate truncated and invalid data
+bool checkScan() {
+    const std::string data = MsgPack(getVariant()).packer();
+    MsgPack::ScanInfo info;
+    bool ans = ((MsgPack::scan(data.data(), data.size(), info) == true) &&
+                (info.size == data.size()) && (info.count == 2) && (info.depth == 2));
+
+    for (std::size_t size = 0; size < data.size(); ++size) {
+        ans &= ((MsgPack::scan(data.data(), size, info) != true) &&
+                (info.error == MsgPack::SCAN_ERROR_TRUNCATED));
+    }
+
+    // 0xc1 is never used
+    const std::string invalid("\x92\x01\xc1", 3);
+    ans &= ((MsgPack::scan(invalid.data(), invalid.size(), info) != true) &&
+            (info.error == MsgPack::SCAN_ERROR_INVALID) && (info.offset == 2));
+
+    const std::string nested = std::string(10, '\x91') + "\x01";
+    ans &= ((MsgPack::scan(nested.data(), nested.size(), info, 9) != true) &&
+            (info.error == MsgPack::SCAN_ERROR_TOO_DEEP) &&
+            (MsgPack::scan(nested.data(), nested.size(), info, 10) == true) && (info.depth == 10));
+
+    // the streaming decoder skips with the same scan
+    MsgPackDecoder decoder;
+    ans &= ((decoder.feed(data.data(), data.size() - 1) == true) && (decoder.available() == 0) &&
+            (decoder.feed(invalid.data(), invalid.size()) != true) && (decoder.good() != true));
+
+    if (ans != true) {
+        std::cerr << "NG (scan)" << std::endl;
+    }
+    return ans;
+}
+
+
+// data nested deeper than the limit must be rejected
+bool checkDepthLimit() {
+    const std::string nested = std::string(10, '\x91') + "\x01";
+
+    MsgPack limited;
+    limited.setMaxDepth(9);
+    MsgPack enough;
+    enough.setMaxDepth(10);
+    if ((limited.unpack(nested.data(), nested.size()) == true) ||
+        (enough.unpack(nested.data(), nested.size()) != true)) {
+        std::cerr << "NG (depth limit)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
 int main() {
     {
         Variant v = getVariant();
@@ -28,5 +535,49 @@ int main() {
         std::cout << v.str() << std::endl;
     }
 
+    if (checkCompactEncodings() != true) {
+        return 1;
+    }
+
+    if (checkWriter() != true) {
+        return 1;
+    }
+
+    if (checkSortKeys() != true) {
+        return 1;
+    }
+
+    if (checkIndex() != true) {
+        return 1;
+    }
+
+    if (checkDepthLimit() != true) {
+        return 1;
+    }
+
+    if (checkDecoder() != true) {
+        return 1;
+    }
+
+    if (checkAppendAndRead() != true) {
+        return 1;
+    }
+
+    if (checkParallelUnpack() != true) {
+        return 1;
+    }
+
+    if (checkParallelPack() != true) {
+        return 1;
+    }
+
+    if (checkSelected() != true) {
+        return 1;
+    }
+
+    if (checkScan() != true) {
+        return 1;
+    }
+
     return 0;
 }
@@ -6,6 +6,12 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <limits>
+#include <thread>
+#include <atomic>
 
 #if (__cplusplus >= 201103L)
 #include <cstdint>  // for C++11 and later
@@ -13,8 +19,69 @@
 #include <stdint.h> // for C++98 compiler (use C99 header)
 #endif // __cplusplus
 
+// mmap is used for loading files where it is available.
+// define MSGPACK_ALT_USE_MMAP to 0 to always read through the file.
+#ifndef MSGPACK_ALT_USE_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define MSGPACK_ALT_USE_MMAP 1
+#else
+#define MSGPACK_ALT_USE_MMAP 0
+#endif
+#endif // MSGPACK_ALT_USE_MMAP
+
+#if MSGPACK_ALT_USE_MMAP
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // MSGPACK_ALT_USE_MMAP
+
 #include "variant.hpp"
 
+/// ファイル全体を読み込み専用でメモリ上に置く
+///
+/// 通常のファイルは mmap し、パイプなど mmap できないものは
+/// 最後まで読み込んでバッファに保持する。
+class MsgPackMappedFile {
+public:
+    MsgPackMappedFile();
+    ~MsgPackMappedFile();
+
+private:
+    MsgPackMappedFile(const MsgPackMappedFile& rhs);
+    MsgPackMappedFile& operator=(const MsgPackMappedFile& rhs);
+
+public:
+    /// @param[in] path ファイルのパス
+    /// @retval true  開くことができた
+    /// @retval false ファイルを開けない、もしくは読み込みに失敗した
+    bool open(const std::string& path);
+    void close();
+
+    const char* data() const {
+        return this->pData_;
+    }
+
+    std::size_t size() const {
+        return this->size_;
+    }
+
+protected:
+    /// 終わりまでバッファに読み込む
+#if MSGPACK_ALT_USE_MMAP
+    bool readAll(int fd);
+#else
+    bool readAll(std::istream& in);
+#endif // MSGPACK_ALT_USE_MMAP
+
+protected:
+    const char* pData_;
+    std::size_t size_;
+    bool mapped_;
+    std::vector<char> buffer_;
+};
+
 class MsgPack {
 public:
     typedef int8_t INT8;
@@ -28,1061 +95,3360 @@ public:
 
 public:
     explicit MsgPack(const Variant& data = Variant());
+    explicit MsgPack(Variant&& data);
     MsgPack(const MsgPack& rhs);
+    MsgPack(MsgPack&& rhs) noexcept;
     ~MsgPack();
 
     MsgPack& operator=(const MsgPack& rhs);
+    MsgPack& operator=(MsgPack&& rhs) noexcept;
 
 public:
     Variant getVariant() const;
 
+    /// 保持しているデータをコピーせずに取り出す
+    ///
+    /// 取り出した後、このオブジェクトのデータは NONE になる
+    Variant takeVariant();
+
     /// MsgPack形式のファイルを読み込む
     ///
+    /// 通常のファイルは mmap して直接デコードする。
+    ///
+    /// @param[in] path   ファイルのパス
+    /// @param[in] pArena 読み込んだデータのメモリ確保先 (NULL の場合はヒープ)
     /// @retval true  ファイルの読み込みに成功した
     /// @retval false ファイルの読み込みに失敗した
-    bool load(const std::string& path);
+    bool load(const std::string& path, VariantArena* pArena = NULL);
 
     /// MsgPack 形式でファイルを書きだす
     ///
     /// @param[in] path ファイルの出力先
     void save(const std::string& path) const;
 
-    void unpacker(const std::string& str);
-    std::string packer() const;
+    /// メモリ上の MsgPack 形式のデータを読み込む
+    ///
+    /// @param[in] pData  読み込むデータの先頭
+    /// @param[in] size   データのバイト数
+    /// @param[in] pArena 読み込んだデータのメモリ確保先 (NULL の場合はヒープ)
+    /// @retval true  読み込みに成功した
+    /// @retval false データが不正、もしくは途中で途切れている
+    bool unpack(const char* pData, std::size_t size, VariantArena* pArena = NULL);
+
+    /// 大きな ARRAY を複数のスレッドでデコードする
+    ///
+    /// 最初に要素の境目だけを調べ、要素をバイト数が均等になるように
+    /// 分けてスレッドごとにデコードし、1つの ARRAY にまとめる。
+    /// 先頭が ARRAY でない場合は unpack と同じ。メモリはヒープから確保する。
+    ///
+    /// @param[in] pData   読み込むデータの先頭
+    /// @param[in] size    データのバイト数
+    /// @param[in] threads 使うスレッド数 (0 の場合はハードウェアのスレッド数)
+    /// @retval true  読み込みに成功した
+    /// @retval false データが不正、もしくは途中で途切れている
+    bool unpackParallel(const char* pData, std::size_t size, unsigned int threads = 0);
+
+    /// 連続して並んだ複数の要素を複数のスレッドでデコードする
+    ///
+    /// 読み込んだ要素を順に並べた ARRAY にする。
+    /// 引数と戻り値は unpackParallel と同じ。
+    bool unpackStreamParallel(const char* pData, std::size_t size, unsigned int threads = 0);
 
-protected:
-    Variant loadBinary(std::istream& ifs);
-    int unpack_positiveFixNum(unsigned char c);
-    int unpack_negativeFixNum(unsigned char c);
-    UINT8 unpack_uint8(std::istream& ifs);
-    UINT16 unpack_uint16(std::istream& ifs);
-    UINT32 unpack_uint32(std::istream& ifs);
-    UINT64 unpack_uint64(std::istream& ifs);
-
-    Variant unpack_bin8(std::istream& ifs);
-    Variant unpack_bin16(std::istream& ifs);
-    Variant unpack_bin32(std::istream& ifs);
-
-    INT8 unpack_int8(std::istream& ifs);
-    INT16 unpack_int16(std::istream& ifs);
-    INT32 unpack_int32(std::istream& ifs);
-    INT64 unpack_int64(std::istream& ifs);
-
-    float unpack_float(std::istream& ifs);
-    double unpack_double(std::istream& ifs);
-
-    Variant unpack_fixraw(const char in, std::istream& ifs);
-    Variant unpack_str8(std::istream& ifs);
-    Variant unpack_str16(std::istream& ifs);
-    Variant unpack_str32(std::istream& ifs);
-
-    Variant unpack_ext8(std::istream& ifs);
-    Variant unpack_ext16(std::istream& ifs);
-    Variant unpack_ext32(std::istream& ifs);
-    Variant unpack_fixext1(std::istream& ifs);
-    Variant unpack_fixext2(std::istream& ifs);
-    Variant unpack_fixext4(std::istream& ifs);
-    Variant unpack_fixext8(std::istream& ifs);
-    Variant unpack_fixext16(std::istream& ifs);
-
-    Variant unpack_fixarray(const char in, std::istream& ifs);
-    Variant unpack_array16(std::istream& ifs);
-    Variant unpack_array32(std::istream& ifs);
-    Variant unpack_fixmap(const char in, std::istream& ifs);
-    Variant unpack_map16(std::istream& ifs);
-    Variant unpack_map32(std::istream& ifs);
-
-    std::string pack(const Variant& data) const;
-    std::string pack_scalar(const Variant& data) const;
-    std::string pack_array(const Variant& data) const;
-    std::string pack_map(const Variant& data) const;
-
-    std::string pack(bool value) const;
-    std::string pack(UINT8 value) const;
-    std::string pack(UINT16 value) const;
-    std::string pack_uint32(UINT32 value) const;
-    std::string pack_uint64(UINT64 value) const;
-    std::string pack(INT8 value) const;
-    std::string pack(INT16 value) const;
-    std::string pack_int32(INT32 value) const;
-    std::string pack_int64(INT64 value) const;
-    std::string pack(double value) const;
-    std::string pack(const std::string& str) const;
-
-    template<typename T>
-    void write(std::ostringstream& os, T value) const {
-        os.write((char*)&value, sizeof(T));
+    /// paths に一致する部分だけをデコードする
+    ///
+    /// パスは "/" で区切ったキーの並び ("group1/subgroup1" など)。MAP は文字列の
+    /// キー、ARRAY は 0 から始まる添字で選び、"*" はすべてのキーと要素に一致する
+    /// ("items/*/id" など)。パスの終わりの要素はその下をすべてデコードし、
+    /// それ以外は Variant を作らずに読み飛ばす。
+    /// 結果は元の構造のうち一致した部分だけを持つ。ARRAY は添字を保つため、
+    /// 選ばれなかった要素は NONE になる (最後に選ばれた要素より後ろは持たない)。
+    /// @param[in] pData  読み込むデータの先頭
+    /// @param[in] size   データのバイト数
+    /// @param[in] paths  デコードする部分のパス (空のパスは全体)
+    /// @param[in] pArena 読み込んだデータのメモリ確保先 (NULL の場合はヒープ)
+    /// @retval true  読み込みに成功した
+    /// @retval false データが不正、もしくは途中で途切れている
+    bool unpackSelected(const char* pData, std::size_t size, const std::vector<std::string>& paths,
+                        VariantArena* pArena = NULL);
+
+    /// 要素を1つ読み、Variant を作らずに内容を順に handler に渡す
+    ///
+    /// Handler には次のメンバ関数が必要 (戻り値は使わない)。
+    ///  - on_nil(), on_bool(bool), on_double(double)
+    ///  - on_int(INT32), on_int(INT64), on_uint(UINT32), on_uint(UINT64)
+    ///    (int64/uint64 形式は 64 ビット版、それ以外は 32 ビット版で呼ぶ。
+    ///     64 ビット版だけを定義してもよい)
+    ///  - on_str(const char*, std::size_t), on_bin(const char*, std::size_t),
+    ///    on_ext(INT8, const char*, std::size_t), on_timestamp(INT64, UINT32)
+    ///    (ポインタは pData の中を指す。呼び出しの後も使う場合はコピーすること)
+    ///  - on_array_begin(std::size_t), on_map_begin(std::size_t), on_end()
+    ///    (ARRAY/MAP の要素を順に渡した後に on_end を呼ぶ。MAP はキーと値を交互に渡す)
+    /// データが途中で不正になった場合は、そこまでの内容を渡して失敗する。
+    /// @param[in] pData   読み込むデータの先頭
+    /// @param[in] size    データのバイト数
+    /// @param[in] handler 内容を受け取るオブジェクト
+    /// @retval true  読み込みに成功した
+    /// @retval false データが不正、もしくは途中で途切れている
+    template<typename Handler>
+    bool parse(const char* pData, std::size_t size, Handler& handler) {
+        Cursor cur(pData, pData + size);
+        this->parseObject(cur, handler);
+        return cur.good;
     }
 
-protected:
-    Variant unpack_ext(std::istream& ifs,
-                               const std::size_t size);
+    /// scan で見つかったエラー
+    enum ScanError {
+        SCAN_ERROR_NONE,        ///< エラーなし
+        SCAN_ERROR_TRUNCATED,   ///< データが途中で途切れている
+        SCAN_ERROR_INVALID,     ///< 不正な型
+        SCAN_ERROR_TOO_DEEP     ///< 入れ子が深すぎる
+    };
+
+    /// scan の結果
+    struct ScanInfo {
+        ScanInfo()
+            : error(SCAN_ERROR_NONE), offset(0), size(0), count(0), depth(0) {
+        }
 
-protected:
-    template<typename T>
-    T changeEndian(T value) const {
-        char* p = reinterpret_cast<char*>(&value);
-        std::reverse(p, p + sizeof(T));
+        ScanError error;
+
+        /// エラーが見つかった要素の先頭のオフセット
+        std::size_t offset;
+
+        /// 先頭の要素のバイト数
+        std::size_t size;
+
+        /// 先頭の要素が ARRAY の場合は要素数、MAP の場合はキーの数、それ以外は 0
+        UINT64 count;
+
+        /// 入れ子の深さの最大値 (ARRAY/MAP 以外は 0、[1] は 1)
+        std::size_t depth;
+    };
+
+    /// 先頭の要素をデコードせずに調べる
+    ///
+    /// メモリを確保せずに要素の終わりまで読み、バイト数、要素数、入れ子の深さを
+    /// 返す。データが不正な場合はエラーの種類とその位置を返す。
+    /// 要素の後ろに続くデータは読まない。
+    /// @param[in]  pData    読み込むデータの先頭
+    /// @param[in]  size     データのバイト数
+    /// @param[out] info     結果
+    /// @param[in]  maxDepth 入れ子の深さの上限 (DEFAULT_MAX_DEPTH より大きい値は DEFAULT_MAX_DEPTH)
+    /// @retval true  正しい MsgPack の要素だった
+    /// @retval false データが不正、もしくは途中で途切れている
+    static bool scan(const char* pData, std::size_t size, ScanInfo& info,
+                     std::size_t maxDepth = DEFAULT_MAX_DEPTH);
+
+    /// 値に応じて最小の形式で書き出すかどうかを設定する
+    ///
+    /// true (デフォルト) の場合、整数は fixint/uint8..64/int8..64、文字列は
+    /// fixstr/str8..32、バイト列は bin8..32、EXT は fixext/ext8..32、
+    /// 配列と連想配列は fixarray/fixmap/16/32 のうち最も短いものを選ぶ。
+    /// TIMESTAMP は timestamp 32/64/96 のうち最も短いものを選ぶ。
+    /// false の場合は int64, str32, bin32, ext32, timestamp 96, array32, map32 の
+    /// 固定長で書き出す。
+    void setCompact(bool compact) {
+        this->compact_ = compact;
+    }
 
-        return value;
+    bool isCompact() const {
+        return this->compact_;
     }
 
-    void changeEndian(char* p, std::size_t size) const {
-        std::reverse(p, p + size);
+    /// 読み込むデータの入れ子の深さの上限を設定する (デフォルトは DEFAULT_MAX_DEPTH)
+    ///
+    /// 読み込みはネイティブのスタックを使わないが、Variant のコピーや
+    /// 破棄は再帰するので、信頼できないデータには上限を設けること。
+    /// これより深いデータの読み込みは失敗する。
+    void setMaxDepth(std::size_t depth) {
+        this->maxDepth_ = depth;
     }
 
-    bool isLittleEndian() const {
-        int i = 1;
-        return *(reinterpret_cast<char*>(&i)) == 1;
+    std::size_t maxDepth() const {
+        return this->maxDepth_;
     }
 
-    bool isBigEndian() const {
-        return !(this->isLittleEndian());
+    static const std::size_t DEFAULT_MAX_DEPTH = 1024;
+
+    /// 文字列をコピーせずに、読み込むデータへの参照としてデコードするかどうかを設定する
+    ///
+    /// true の場合、Variant に直接入らない長さの文字列は unpack に渡したデータを
+    /// 直接参照する (Variant::set_view)。データはデコードした Variant を
+    /// 使い終わるまで保持しておくこと。データより長く使う場合は
+    /// Variant::detach でコピーを持たせる。load はファイルを閉じるので常にコピーする。
+    /// デフォルトは false。
+    void setStringView(bool view) {
+        this->stringView_ = view;
     }
 
-    template<typename T>
-    T toBigEndian(T value) const {
-        if (this->isLittleEndian() == true) {
-            value = this->changeEndian(value);
-        }
-        return value;
+    bool isStringView() const {
+        return this->stringView_;
     }
 
-    template<typename T>
-    T toLittleEndian(T value) const {
-        if (this->isBigEndian() == true) {
-            value = this->changeEndian(value);
-        }
-        return value;
+    void unpacker(const std::string& str, VariantArena* pArena = NULL);
+    std::string packer() const;
+
+    /// MsgPack 形式で out の末尾に追記する
+    ///
+    /// Buffer には append(const char*, std::size_t) と push_back(char) が
+    /// 必要 (std::string など)。全体を1つのバッファに1パスで書き出す。
+    /// @param[out] out 出力先
+    template<typename Buffer>
+    void packer(Buffer& out) const {
+        this->pack(this->data_, out);
+    }
+
+    /// MsgPack 形式で pOut に書き出す
+    ///
+    /// 共有メモリや送信用のバッファなど、確保済みの領域に直接書き出す場合に使う。
+    /// 必要なバイト数は encodedSize で調べられる。
+    /// @param[out] pOut     出力先
+    /// @param[in]  capacity pOut に書き込めるバイト数
+    /// @return 書き出したバイト数 (capacity が足りない場合は何も書かずに 0)
+    std::size_t packer(char* pOut, std::size_t capacity) const;
+
+    /// MsgPack 形式で書き出した場合のバイト数 (setCompact に従う)
+    ///
+    /// 書き出さずに数えるだけなので、大きさの上限を確かめる場合などにも使える。
+    std::size_t encodedSize() const {
+        return this->encodedSize(this->data_);
     }
 
+    std::size_t encodedSize(const Variant& data) const;
+
+    /// 大きな ARRAY/MAP を複数のスレッドで書き出す
+    ///
+    /// 先頭の ARRAY/MAP の要素を数が均等になるように分け、まとまりごとに
+    /// 別のバッファに書き出す。pieces を順につなげたものは packer() の結果と
+    /// 同じになるので、writev などでそのまま書き出せる (pieces[0] はヘッダ)。
+    /// ARRAY/MAP 以外や要素が少ない場合は pieces を1つだけ作る。
+    /// 分けるのは先頭の ARRAY/MAP の要素だけで、それぞれの要素は1つのスレッドで書き出す。
+    /// @param[out] pieces  書き出したデータ (前の内容は捨てる)
+    /// @param[in]  threads 使うスレッド数 (0 の場合はハードウェアのスレッド数)
+    void packerParallel(std::vector<std::string>& pieces, unsigned int threads = 0) const;
+
+    /// packerParallel の結果をつなげて返す (packer() と同じ結果になる)
+    std::string packerParallel(unsigned int threads = 0) const;
+
 protected:
-    Variant data_;
+    /// バッファの読み込み位置
+    struct Cursor {
+        Cursor(const char* pBegin, const char* pEnd, VariantArena* pArena_ = NULL)
+            : begin(pBegin), p(pBegin), end(pEnd), good(true), pArena(pArena_) {
+        }
 
-    /// デバッグ用変数
-    /// 現在の読み込み位置(byte)を記憶する
-    std::size_t debugCurrentPos_;
-};
+        /// 残りが size バイト以上あるかどうかを調べる
+        ///
+        /// 足りない場合は読み込み失敗として終端まで進める
+        bool require(const std::size_t size) {
+            if (static_cast<std::size_t>(this->end - this->p) < size) {
+                this->p = this->end;
+                this->good = false;
+            }
+            return this->good;
+        }
 
+        const char* begin;
+        const char* p;
+        const char* end;
+        bool good;
 
-// Implementation **************************************************************
-MsgPack::MsgPack(const Variant& data) : data_(data) {
-}
+        /// 読み込んだ Variant のメモリ確保先
+        VariantArena* pArena;
+    };
 
+protected:
+    /// pack の Buffer として書き出すバイト数だけを数える
+    struct SizeCounter {
+        SizeCounter() : size(0) {
+        }
 
-MsgPack::MsgPack(const MsgPack& rhs) : data_(rhs.data_) {
-}
+        void append(const char*, const std::size_t n) {
+            this->size += n;
+        }
 
+        void push_back(char) {
+            ++this->size;
+        }
 
-MsgPack::~MsgPack() {
-}
+        std::size_t size;
+    };
 
+    /// pack の Buffer として確保済みの領域に書き込む (大きさは確かめない)
+    struct RawBuffer {
+        explicit RawBuffer(char* pOut) : p(pOut) {
+        }
 
-MsgPack& MsgPack::operator=(const MsgPack& rhs) {
-    if (this != &rhs) {
-        this->data_ = rhs.data_;
-    }
+        void append(const char* pData, const std::size_t n) {
+            std::memcpy(this->p, pData, n);
+            this->p += n;
+        }
 
-    return *this;
-}
+        void push_back(const char c) {
+            *this->p++ = c;
+        }
 
+        char* p;
+    };
 
-Variant MsgPack::getVariant() const {
-    return this->data_;
-}
+protected:
+    /// 入れ子になったコンテナを読んでいる途中の状態
+    struct Frame {
+        Frame(Variant* pNode_, std::size_t remaining_, bool isMap_, VariantArena* pArena)
+            : pNode(pNode_), remaining(remaining_), isMap(isMap_), inKey(false), key(pArena) {
+        }
 
+        Variant* pNode;         ///< 読み込み先 (NULL の場合は1つ下の Frame の key)
+        std::size_t remaining;  ///< まだ読み始めていない要素 (MAP はキーと値の組) の数
+        bool isMap;
+        bool inKey;             ///< MAP のキーを読んでいる
+        Variant key;            ///< 読んでいる途中の MAP のキー
+    };
 
-bool MsgPack::load(const std::string& path) {
-    std::ifstream ifs;
-    ifs.open(path.c_str(), std::ios::in | std::ios::binary);
-    if (!ifs) {
-        return false;
-    }
+    /// parse の handler として Variant を組み立てる
+    ///
+    /// 入れ子は MsgPack::stack_ で管理し、要素は最終的な位置に直接読み込む。
+    class VariantBuilder {
+    public:
+        /// @param[in] msgpack stack_ と設定を使う MsgPack
+        /// @param[in] cur     読み込み中の位置 (メモリ確保先と残りのバイト数を使う)
+        /// @param[out] root   読み込み先
+        VariantBuilder(MsgPack& msgpack, const Cursor& cur, Variant& root)
+            : msgpack_(msgpack), cur_(cur), pTarget_(&root) {
+            this->msgpack_.stack_.clear();
+        }
 
-    this->debugCurrentPos_ = 0; // initialize
-    this->data_ = this->loadBinary(ifs);
-    return true;
-}
+        void on_nil() {
+            this->complete();
+        }
 
+        void on_bool(const bool value) {
+            this->pTarget_->set(value);
+            this->complete();
+        }
 
-void MsgPack::unpacker(const std::string& str) {
-    std::istringstream iss(str);
-    this->debugCurrentPos_ = 0; // initialize
-    this->data_ = this->loadBinary(iss);
-}
+        void on_int(const INT32 value) {
+            this->pTarget_->set(static_cast<int>(value));
+            this->complete();
+        }
 
+        void on_int(const INT64 value) {
+            this->pTarget_->set(static_cast<long>(value));
+            this->complete();
+        }
 
-Variant MsgPack::loadBinary(std::istream& ifs) {
-    Variant ans;
+        void on_uint(const UINT32 value) {
+            this->pTarget_->set(static_cast<unsigned int>(value));
+            this->complete();
+        }
 
-    if (ifs.eof() != true) {
-        unsigned char c;
-        ifs.read((char*)&c, 1);
-        ++(this->debugCurrentPos_);
+        void on_uint(const UINT64 value) {
+            this->pTarget_->set(static_cast<unsigned long>(value));
+            this->complete();
+        }
 
-        switch (c) {
-        case (unsigned char)(0xc0):
-            // do nothing
-            break;
+        void on_double(const double value) {
+            this->pTarget_->set(value);
+            this->complete();
+        }
 
-        case (unsigned char)(0xc2):
-            ans.set(false);
-            break;
+        void on_str(const char* pStr, const std::size_t size) {
+            if (this->msgpack_.stringView_ == true) {
+                this->pTarget_->set_view(pStr, size);
+            } else {
+                this->pTarget_->set(pStr, size);
+            }
+            this->complete();
+        }
 
-        case (unsigned char)(0xc3):
-            ans.set(true);
-            break;
+        void on_bin(const char* pData, const std::size_t size) {
+            this->pTarget_->set_binary(pData, size, this->msgpack_.stringView_);
+            this->complete();
+        }
 
-        case (unsigned char)(0xc4):
-            ans = this->unpack_bin8(ifs);
-            break;
+        void on_ext(const INT8 type, const char* pData, const std::size_t size) {
+            this->pTarget_->set_ext(type, pData, size, this->msgpack_.stringView_);
+            this->complete();
+        }
 
-        case (unsigned char)(0xc5):
-            ans = this->unpack_bin16(ifs);
-            break;
+        void on_timestamp(const INT64 seconds, const UINT32 nanoseconds) {
+            this->pTarget_->set_timestamp(seconds, nanoseconds);
+            this->complete();
+        }
 
-        case (unsigned char)(0xc6):
-            ans = this->unpack_bin32(ifs);
-            break;
+        void on_array_begin(const std::size_t size) {
+            this->begin(size, false);
+        }
 
-        case (unsigned char)(0xc7):
-            ans = this->unpack_ext8(ifs);
-            break;
+        void on_map_begin(const std::size_t size) {
+            this->begin(size, true);
+        }
 
-        case (unsigned char)(0xc8):
-            ans = this->unpack_ext16(ifs);
-            break;
+        void on_end() {
+            this->msgpack_.stack_.pop_back();
+            this->complete();
+        }
 
-        case (unsigned char)(0xc9):
-            ans = this->unpack_ext32(ifs);
-            break;
+    protected:
+        /// *pTarget_ をコンテナにして、最初の要素の読み込み先に進む
+        void begin(std::size_t size, bool isMap);
 
-        case (unsigned char)(0xca):
-            ans = this->unpack_float(ifs);
-            break;
+        /// *pTarget_ を読み終わったので、次の読み込み先に進む
+        void complete();
 
-        case (unsigned char)(0xcb):
-            ans = this->unpack_double(ifs);
-            break;
+        /// stack_ の一番上のコンテナの次の要素に進む
+        void next();
 
-        case (unsigned char)(0xcc):
-            ans = this->unpack_uint8(ifs);
-            break;
+        /// stack_ の i 番目の読み込み先
+        Variant& frameNode(const std::size_t i) {
+            std::vector<Frame>& stack = this->msgpack_.stack_;
+            return (stack[i].pNode != NULL) ? *(stack[i].pNode) : stack[i - 1].key;
+        }
 
-        case (unsigned char)(0xcd):
-            ans = this->unpack_uint16(ifs);
-            break;
+    protected:
+        MsgPack& msgpack_;
+        const Cursor& cur_;
 
-        case (unsigned char)(0xce):
-            ans = this->unpack_uint32(ifs);
-            break;
+        /// 次の値の読み込み先 (NULL の場合は on_end を待っている)
+        Variant* pTarget_;
+    };
 
-        case (unsigned char)(0xcf):
-            ans = (unsigned long)this->unpack_uint64(ifs);
-            break;
+    /// 1つの要素を読む
+    ///
+    /// 再帰せず、入れ子は stack_ で管理する。maxDepth_ より深い場合は失敗する。
+    Variant loadBinary(Cursor& cur);
 
-        case (unsigned char)(0xd0):
-            ans = this->unpack_int8(ifs);
-            break;
+    /// 1つの要素を読み、内容を handler に順に渡す
+    ///
+    /// 再帰せず、入れ子は levels_ で管理する。maxDepth_ より深い場合は失敗する。
+    template<typename Handler>
+    void parseObject(Cursor& cur, Handler& handler);
 
-        case (unsigned char)(0xd1):
-            ans = this->unpack_int16(ifs);
-            break;
+    /// コンテナ以外の要素を handler に渡す
+    template<typename Handler>
+    void parseScalar(const unsigned char c, Cursor& cur, Handler& handler);
+    int unpack_positiveFixNum(unsigned char c);
+    int unpack_negativeFixNum(unsigned char c);
+    UINT8 unpack_uint8(Cursor& cur);
+    UINT16 unpack_uint16(Cursor& cur);
+    UINT32 unpack_uint32(Cursor& cur);
+    UINT64 unpack_uint64(Cursor& cur);
+
+
+    INT8 unpack_int8(Cursor& cur);
+    INT16 unpack_int16(Cursor& cur);
+    INT32 unpack_int32(Cursor& cur);
+    INT64 unpack_int64(Cursor& cur);
+
+    float unpack_float(Cursor& cur);
+    double unpack_double(Cursor& cur);
+
+    /// size バイトの文字列・バイト列・拡張型を handler に渡す
+    template<typename Handler>
+    void parse_str(Cursor& cur, std::size_t size, Handler& handler);
+    template<typename Handler>
+    void parse_bin(Cursor& cur, std::size_t size, Handler& handler);
+    template<typename Handler>
+    void parse_ext(Cursor& cur, std::size_t size, Handler& handler);
+
+
+    template<typename Buffer>
+    void pack(const Variant& data, Buffer& out) const;
+    template<typename Buffer>
+    void pack_scalar(const Variant& data, Buffer& out) const;
+    template<typename Buffer>
+    void pack_array(const Variant& data, Buffer& out) const;
+    template<typename Buffer>
+    void pack_map(const Variant& data, Buffer& out) const;
+
+    template<typename Buffer>
+    void pack(bool value, Buffer& out) const;
+    template<typename Buffer>
+    void pack(UINT8 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack(UINT16 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack_uint32(UINT32 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack_uint64(UINT64 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack(INT8 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack(INT16 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack_int32(INT32 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack_int64(INT64 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack(double value, Buffer& out) const;
+    template<typename Buffer>
+    void pack(const std::string& str, Buffer& out) const;
+    template<typename Buffer>
+    void pack_str(const char* pStr, UINT32 size, Buffer& out) const;
+    template<typename Buffer>
+    void pack_bin(const char* pData, UINT32 size, Buffer& out) const;
+    template<typename Buffer>
+    void pack_ext(INT8 type, const char* pData, UINT32 size, Buffer& out) const;
+    template<typename Buffer>
+    void pack_timestamp(INT64 seconds, UINT32 nanoseconds, Buffer& out) const;
+
+    template<typename Buffer>
+    void pack_int(INT64 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack_uint(UINT64 value, Buffer& out) const;
+    template<typename Buffer>
+    void pack_str_header(UINT32 size, Buffer& out) const;
+    template<typename Buffer>
+    void pack_bin_header(UINT32 size, Buffer& out) const;
+    template<typename Buffer>
+    void pack_ext_header(INT8 type, UINT32 size, Buffer& out) const;
+    template<typename Buffer>
+    void pack_array_header(UINT32 size, Buffer& out) const;
+    template<typename Buffer>
+    void pack_map_header(UINT32 size, Buffer& out) const;
+
+    template<typename Buffer>
+    void write(Buffer& out, const char c) const {
+        out.push_back(c);
+    }
 
-        case (unsigned char)(0xd2):
-            ans = this->unpack_int32(ifs);
-            break;
+    // big endian で書き込む (ホストのエンディアンに依存しない)
+    template<typename Buffer>
+    void write_be16(Buffer& out, const UINT16 value) const {
+        const char buf[2] = { char(value >> 8), char(value) };
+        out.append(buf, 2);
+    }
 
-        case (unsigned char)(0xd3):
-            ans = (long)this->unpack_int64(ifs);
-            break;
+    template<typename Buffer>
+    void write_be32(Buffer& out, const UINT32 value) const {
+        const char buf[4] = { char(value >> 24), char(value >> 16),
+                              char(value >> 8), char(value) };
+        out.append(buf, 4);
+    }
 
-        case (unsigned char)(0xd4):
-            ans = this->unpack_fixext1(ifs);
-            break;
+    template<typename Buffer>
+    void write_be64(Buffer& out, const UINT64 value) const {
+        this->write_be32(out, UINT32(value >> 32));
+        this->write_be32(out, UINT32(value));
+    }
 
-        case (unsigned char)(0xd5):
-            ans = this->unpack_fixext2(ifs);
-            break;
+protected:
+    /// timestamp 拡張型 (4, 8, 12 バイト) の内容を読む
+    ///
+    /// @retval false 大きさか値が timestamp として正しくない (EXT のまま読む)
+    static bool unpack_timestamp(const char* p, std::size_t size, INT64& seconds, UINT32& nanoseconds);
 
-        case (unsigned char)(0xd6):
-            ans = this->unpack_fixext4(ifs);
-            break;
+    /// timestamp 拡張型の型の番号
+    static const INT8 TIMESTAMP_TYPE = -1;
 
-        case (unsigned char)(0xd7):
-            ans = this->unpack_fixext8(ifs);
-            break;
+protected:
+    /// scanObject の結果
+    enum ScanResult {
+        SCAN_COMPLETE,
+        SCAN_INCOMPLETE,
+        SCAN_INVALID
+    };
+
+    /// 要素の型と長さを表す部分 (数値の場合は値まで) を読む
+    ///
+    /// @param[in]  p        要素の先頭
+    /// @param[in]  size     p から読めるバイト数 (1 以上)
+    /// @param[out] bodySize 続くデータ (文字列など) のバイト数
+    /// @param[out] children 続く子要素の数 (MAP はキーと値を別に数える)
+    /// @return 型と長さを表す部分のバイト数 (不正な型の場合は 0)。
+    ///         size がこれより小さい場合、bodySize と children は設定しない
+    static std::size_t scanHeader(const char* p, std::size_t size, UINT64& bodySize, UINT64& children);
+
+    /// デコードせずに要素の終わりまで読み飛ばす
+    ///
+    /// データが途中で終わった場合は pos と remaining を次の呼び出しに渡すと、
+    /// 続きのデータを加えたところから再開する。
+    /// @param[in]     p         データの先頭
+    /// @param[in]     size      データのバイト数
+    /// @param[in,out] pos       次に読む位置 (p からのオフセット)
+    /// @param[in,out] remaining 読み終わっていない要素の数 (最初は 1)
+    static ScanResult scanObject(const char* p, std::size_t size, std::size_t& pos, UINT64& remaining);
+
+    /// unpackSelected のパスの木の節
+    struct PathNode {
+        PathNode() : children(), indices(), wildcard(0), leaf(false) {
+        }
 
-        case (unsigned char)(0xd8):
-            ans = this->unpack_fixext16(ifs);
-            break;
+        /// キー (添字) と子の節の番号。"*" に一致する部分も含む
+        std::vector<std::pair<std::string, std::size_t> > children;
 
-        case (unsigned char)(0xd9):
-            ans = this->unpack_str8(ifs);
-            break;
+        /// children のうち ARRAY の添字として読めるもの (添字の昇順)
+        std::vector<std::pair<UINT64, std::size_t> > indices;
 
-        case (unsigned char)(0xda):
-            ans = this->unpack_str16(ifs);
-            break;
+        /// "*" の子の節の番号 (ない場合は 0)
+        std::size_t wildcard;
 
-        case (unsigned char)(0xdb):
-            ans = this->unpack_str32(ifs);
-            break;
+        /// この下をすべてデコードする
+        bool leaf;
+    };
 
-        case (unsigned char)(0xdc):
-            ans = this->unpack_array16(ifs);
-            break;
+    /// suffixes (パスの残りの部分) から節を作り、その番号を返す
+    ///
+    /// "*" に続く部分は同じ階層のキーの子にも加えるので、1つのキーに対して
+    /// 調べる子は1つで済む。
+    static std::size_t buildPathNode(const std::vector<std::vector<std::string> >& suffixes,
+                                     std::size_t depth, std::vector<PathNode>& nodes);
 
-        case (unsigned char)(0xdd):
-            ans = this->unpack_array32(ifs);
-            break;
+    /// nodes[node] に一致する部分を out に読む
+    ///
+    /// @retval true 一致する部分があった (out に読んだ)
+    bool loadSelected(Cursor& cur, const std::vector<PathNode>& nodes, std::size_t node,
+                      std::size_t depth, Variant& out);
 
-        case (unsigned char)(0xde):
-            ans = this->unpack_map16(ifs);
-            break;
+    /// 要素を1つデコードせずに読み飛ばす
+    static void skipObject(Cursor& cur);
 
-        case (unsigned char)(0xdf):
-            ans = this->unpack_map32(ifs);
-            break;
+    /// [begin, end) に並んだ count 個の要素を threads 個のスレッドで ARRAY にデコードする
+    ///
+    /// stream が true の場合は count に関係なく end まで読む
+    bool decodeParallel(const char* pData, std::size_t begin, std::size_t end,
+                        UINT64 count, bool stream, unsigned int threads);
+
+    /// begin から count 個の要素を threads 個のスレッドで pieces[1] 以降に書き出す
+    template<typename Iterator>
+    void packChildren(Iterator begin, std::size_t count, unsigned int threads,
+                      std::vector<std::string>& pieces) const;
+
+    /// packChildren の1つの要素 (MAP はキーと値) を書き出す
+    void pack_element(const Variant::ArrayConstIterator& p, std::string& out) const {
+        this->pack(*p, out);
+    }
 
-        default:
-            if (c <= (unsigned char)(0x7f)) {
-                ans = this->unpack_positiveFixNum(c);
-            } else if (((unsigned char)(0xe0) <= c) && (c <= (unsigned char)(0xff))) {
-                ans = this->unpack_negativeFixNum(c);
-            } else if (((unsigned char)(0xa0) <= c) && (c <= (unsigned char)(0xbf))) {
-                ans = this->unpack_fixraw(c, ifs);
-            } else if (((unsigned char)(0x90) <= c) && (c <= (unsigned char)(0x9f))) {
-                ans = this->unpack_fixarray(c, ifs);
-            } else if (((unsigned char)(0x80) <= c) && (c <= (unsigned char)(0x8f))) {
-                ans = this->unpack_fixmap(c, ifs);
-            } else {
-                std::cerr << "msgpack unknown id=";
-                std::cerr << std::hex << std::showbase << c;
-                std::cerr << " @ ";
-                std::cerr << this->debugCurrentPos_;
-                std::cerr << std::endl;
-                abort();
-            }
-            break;
-        }
+    void pack_element(const Variant::MapConstIterator& p, std::string& out) const {
+        this->pack(p->first, out);
+        this->pack(p->second, out);
     }
 
-    return ans;
+    friend class MsgPackDecoder;
+    friend class MsgPackReader;
+    friend class MsgPackAppender;
+    friend class MsgPackWriter;
+    friend class MsgPackIndex;
+
+protected:
+    // big endian のバイト列を読む (ホストのエンディアンに依存しない)
+    static UINT16 load_be16(const char* p) {
+        const unsigned char* q = reinterpret_cast<const unsigned char*>(p);
+        return static_cast<UINT16>((UINT16(q[0]) << 8) | UINT16(q[1]));
+    }
+
+    static UINT32 load_be32(const char* p) {
+        const unsigned char* q = reinterpret_cast<const unsigned char*>(p);
+        return ((UINT32(q[0]) << 24) | (UINT32(q[1]) << 16) |
+                (UINT32(q[2]) << 8) | UINT32(q[3]));
+    }
+
+    static UINT64 load_be64(const char* p) {
+        return ((UINT64(load_be32(p)) << 32) | UINT64(load_be32(p + 4)));
+    }
+
+protected:
+    Variant data_;
+
+    /// 最小の形式で書き出す
+    bool compact_;
+
+    /// 入れ子の深さの上限
+    std::size_t maxDepth_;
+
+    /// 文字列を読み込むデータへの参照としてデコードする
+    bool stringView_;
+
+    /// loadBinary の作業領域 (呼び出しの間で使い回す)
+    std::vector<Frame> stack_;
+
+    /// parseObject の作業領域 (コンテナごとの読み終わっていない要素の数)
+    std::vector<UINT64> levels_;
+};
+
+
+// Implementation **************************************************************
+MsgPack::MsgPack(const Variant& data)
+    : data_(data), compact_(true), maxDepth_(DEFAULT_MAX_DEPTH), stringView_(false) {
 }
 
 
-int MsgPack::unpack_positiveFixNum(unsigned char c) {
-    return (c & 127);
+MsgPack::MsgPack(Variant&& data)
+    : data_(std::move(data)), compact_(true), maxDepth_(DEFAULT_MAX_DEPTH), stringView_(false) {
 }
 
 
-int MsgPack::unpack_negativeFixNum(unsigned char c) {
-    return -(c & 31);
+MsgPack::MsgPack(const MsgPack& rhs)
+    : data_(rhs.data_), compact_(rhs.compact_), maxDepth_(rhs.maxDepth_), stringView_(rhs.stringView_) {
+}
+
+
+MsgPack::MsgPack(MsgPack&& rhs) noexcept
+    : data_(std::move(rhs.data_)), compact_(rhs.compact_), maxDepth_(rhs.maxDepth_), stringView_(rhs.stringView_) {
 }
 
 
-Variant MsgPack::unpack_bin8(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint8(ifs);
+MsgPack::~MsgPack() {
+}
+
+
+MsgPack& MsgPack::operator=(const MsgPack& rhs) {
+    if (this != &rhs) {
+        this->data_ = rhs.data_;
+        this->compact_ = rhs.compact_;
+        this->maxDepth_ = rhs.maxDepth_;
+        this->stringView_ = rhs.stringView_;
+    }
 
-    Variant ans;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
+    return *this;
+}
 
-        const std::string str(pBuf, size);
-        ans.set(str);
 
-        delete[] pBuf;
-        pBuf = NULL;
+MsgPack& MsgPack::operator=(MsgPack&& rhs) noexcept {
+    if (this != &rhs) {
+        this->data_ = std::move(rhs.data_);
+        this->compact_ = rhs.compact_;
+        this->maxDepth_ = rhs.maxDepth_;
+        this->stringView_ = rhs.stringView_;
     }
 
-    return ans;
+    return *this;
 }
 
 
-Variant MsgPack::unpack_bin16(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint16(ifs);
+Variant MsgPack::getVariant() const {
+    return this->data_;
+}
+
 
-    Variant ans;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
+Variant MsgPack::takeVariant() {
+    return std::move(this->data_);
+}
 
-        const std::string str(pBuf, size);
-        ans.set(str);
 
-        delete[] pBuf;
-        pBuf = NULL;
+bool MsgPack::load(const std::string& path, VariantArena* pArena) {
+    MsgPackMappedFile file;
+    if (file.open(path) != true) {
+        return false;
     }
 
+    // the decoded tree owns copies, so the mapping can go away afterwards
+    const bool view = this->stringView_;
+    this->stringView_ = false;
+    const bool ans = this->unpack(file.data(), file.size(), pArena);
+    this->stringView_ = view;
     return ans;
 }
 
 
-Variant MsgPack::unpack_bin32(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint32(ifs);
+void MsgPack::unpacker(const std::string& str, VariantArena* pArena) {
+    this->unpack(str.data(), str.size(), pArena);
+}
+
+
+bool MsgPack::unpack(const char* pData, const std::size_t size, VariantArena* pArena) {
+    Cursor cur(pData, pData + size, pArena);
+    Variant ans = this->loadBinary(cur);
 
-    Variant ans;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
+    // data_ belongs to the arena of the decoded tree
+    this->data_.reset(pArena);
+    this->data_ = std::move(ans);
 
-        const std::string str(pBuf, size);
-        ans.set(str);
+    return cur.good;
+}
 
-        delete[] pBuf;
-        pBuf = NULL;
-    }
 
+Variant MsgPack::loadBinary(Cursor& cur) {
+    Variant ans(cur.pArena);
+    VariantBuilder builder(*this, cur, ans);
+    this->parseObject(cur, builder);
+
+    this->stack_.clear();
     return ans;
 }
 
 
-Variant MsgPack::unpack_ext(std::istream& ifs,
-                            const std::size_t size) {
-    const int type = this->unpack_int8(ifs);
-    Variant data;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
+template<typename Handler>
+void MsgPack::parseObject(Cursor& cur, Handler& handler) {
+    this->levels_.clear();
+
+    while (cur.require(1) == true) {
+        const unsigned char c = static_cast<unsigned char>(*(cur.p));
+        ++(cur.p);
+
+        bool isContainer = true;
+        bool isMap = false;
+        std::size_t size = 0;
+        if ((c & 0xf0) == 0x90) {
+            size = (c & 15);
+        } else if ((c & 0xf0) == 0x80) {
+            isMap = true;
+            size = (c & 15);
+        } else if (c == (unsigned char)(0xdc)) {
+            size = this->unpack_uint16(cur);
+        } else if (c == (unsigned char)(0xdd)) {
+            size = this->unpack_uint32(cur);
+        } else if (c == (unsigned char)(0xde)) {
+            isMap = true;
+            size = this->unpack_uint16(cur);
+        } else if (c == (unsigned char)(0xdf)) {
+            isMap = true;
+            size = this->unpack_uint32(cur);
+        } else {
+            isContainer = false;
+            this->parseScalar(c, cur, handler);
+        }
+        if (cur.good != true) {
+            break;
+        }
+
+        if (isContainer == true) {
+            if (this->levels_.size() >= this->maxDepth_) {
+                cur.p = cur.end;
+                cur.good = false;
+                break;
+            }
 
-        const std::string str(pBuf, size);
-        data.set(str);
+            if (isMap == true) {
+                handler.on_map_begin(size);
+            } else {
+                handler.on_array_begin(size);
+            }
+            if (size > 0) {
+                this->levels_.push_back((isMap == true) ? (2 * UINT64(size)) : UINT64(size));
+                continue;
+            }
+            handler.on_end();
+        }
 
-        delete[] pBuf;
-        pBuf = NULL;
+        // the value is complete: close every container it completes
+        while ((this->levels_.empty() != true) && (--(this->levels_.back()) == 0)) {
+            this->levels_.pop_back();
+            handler.on_end();
+        }
+        if (this->levels_.empty() == true) {
+            break;
+        }
     }
+}
 
-    Variant ans;
-    ans.push_back(type);
-    ans.push_back(data);
 
-    return ans;
-}
+template<typename Handler>
+void MsgPack::parseScalar(const unsigned char c, Cursor& cur, Handler& handler) {
+    switch (c) {
+    case (unsigned char)(0xc0):
+        handler.on_nil();
+        break;
+
+    case (unsigned char)(0xc2):
+        handler.on_bool(false);
+        break;
+
+    case (unsigned char)(0xc3):
+        handler.on_bool(true);
+        break;
+
+    case (unsigned char)(0xc4):
+        this->parse_bin(cur, this->unpack_uint8(cur), handler);
+        break;
+
+    case (unsigned char)(0xc5):
+        this->parse_bin(cur, this->unpack_uint16(cur), handler);
+        break;
+
+    case (unsigned char)(0xc6):
+        this->parse_bin(cur, this->unpack_uint32(cur), handler);
+        break;
+
+    case (unsigned char)(0xc7):
+        this->parse_ext(cur, this->unpack_uint8(cur), handler);
+        break;
+
+    case (unsigned char)(0xc8):
+        this->parse_ext(cur, this->unpack_uint16(cur), handler);
+        break;
+
+    case (unsigned char)(0xc9):
+        this->parse_ext(cur, this->unpack_uint32(cur), handler);
+        break;
+
+    case (unsigned char)(0xca):
+        {
+            const double value = this->unpack_float(cur);
+            if (cur.good == true) {
+                handler.on_double(value);
+            }
+        }
+        break;
 
+    case (unsigned char)(0xcb):
+        {
+            const double value = this->unpack_double(cur);
+            if (cur.good == true) {
+                handler.on_double(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xcc):
+        {
+            const UINT32 value = this->unpack_uint8(cur);
+            if (cur.good == true) {
+                handler.on_uint(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xcd):
+        {
+            const UINT32 value = this->unpack_uint16(cur);
+            if (cur.good == true) {
+                handler.on_uint(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xce):
+        {
+            const UINT32 value = this->unpack_uint32(cur);
+            if (cur.good == true) {
+                handler.on_uint(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xcf):
+        {
+            const UINT64 value = this->unpack_uint64(cur);
+            if (cur.good == true) {
+                handler.on_uint(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xd0):
+        {
+            const INT32 value = this->unpack_int8(cur);
+            if (cur.good == true) {
+                handler.on_int(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xd1):
+        {
+            const INT32 value = this->unpack_int16(cur);
+            if (cur.good == true) {
+                handler.on_int(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xd2):
+        {
+            const INT32 value = this->unpack_int32(cur);
+            if (cur.good == true) {
+                handler.on_int(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xd3):
+        {
+            const INT64 value = this->unpack_int64(cur);
+            if (cur.good == true) {
+                handler.on_int(value);
+            }
+        }
+        break;
+
+    case (unsigned char)(0xd4):
+        this->parse_ext(cur, 1, handler);
+        break;
+
+    case (unsigned char)(0xd5):
+        this->parse_ext(cur, 2, handler);
+        break;
+
+    case (unsigned char)(0xd6):
+        this->parse_ext(cur, 4, handler);
+        break;
+
+    case (unsigned char)(0xd7):
+        this->parse_ext(cur, 8, handler);
+        break;
+
+    case (unsigned char)(0xd8):
+        this->parse_ext(cur, 16, handler);
+        break;
+
+    case (unsigned char)(0xd9):
+        // NOT support UTF-8!
+        this->parse_str(cur, this->unpack_uint8(cur), handler);
+        break;
+
+    case (unsigned char)(0xda):
+        this->parse_str(cur, this->unpack_uint16(cur), handler);
+        break;
+
+    case (unsigned char)(0xdb):
+        this->parse_str(cur, this->unpack_uint32(cur), handler);
+        break;
+
+    default:
+        if (c <= (unsigned char)(0x7f)) {
+            handler.on_int(INT32(this->unpack_positiveFixNum(c)));
+        } else if ((unsigned char)(0xe0) <= c) {
+            handler.on_int(INT32(this->unpack_negativeFixNum(c)));
+        } else if (((unsigned char)(0xa0) <= c) && (c <= (unsigned char)(0xbf))) {
+            this->parse_str(cur, (c & 31), handler);
+        } else {
+            std::cerr << "msgpack unknown id=";
+            std::cerr << std::hex << std::showbase << static_cast<int>(c);
+            std::cerr << " @ ";
+            std::cerr << std::dec << (cur.p - cur.begin - 1);
+            std::cerr << std::endl;
+            cur.p = cur.end;
+            cur.good = false;
+        }
+        break;
+    }
+}
+
+
+template<typename Handler>
+void MsgPack::parse_str(Cursor& cur, const std::size_t size, Handler& handler) {
+    if (cur.require(size) == true) {
+        handler.on_str(cur.p, size);
+        cur.p += size;
+    }
+}
+
+
+template<typename Handler>
+void MsgPack::parse_bin(Cursor& cur, const std::size_t size, Handler& handler) {
+    if (cur.require(size) == true) {
+        handler.on_bin(cur.p, size);
+        cur.p += size;
+    }
+}
+
+
+template<typename Handler>
+void MsgPack::parse_ext(Cursor& cur, const std::size_t size, Handler& handler) {
+    const INT8 type = this->unpack_int8(cur);
+    if (cur.require(size) == true) {
+        INT64 seconds = 0;
+        UINT32 nanoseconds = 0;
+        if ((type == TIMESTAMP_TYPE) && (unpack_timestamp(cur.p, size, seconds, nanoseconds) == true)) {
+            handler.on_timestamp(seconds, nanoseconds);
+        } else {
+            handler.on_ext(type, cur.p, size);
+        }
+        cur.p += size;
+    }
+}
+
+
+void MsgPack::VariantBuilder::begin(const std::size_t size, const bool isMap) {
+    Variant& node = *(this->pTarget_);
+    node = Variant(this->cur_.pArena, (isMap == true) ? Variant::MAP : Variant::ARRAY);
+    if ((isMap != true) && (size > 0)) {
+        // every element takes at least one byte
+        node.reserve(std::min<std::size_t>(size, this->cur_.end - this->cur_.p));
+    }
+
+    // pTarget_ may be the key of the top frame, which moves when stack_ grows
+    std::vector<Frame>& stack = this->msgpack_.stack_;
+    const bool inKey = ((stack.empty() != true) && (stack.back().inKey == true));
+    stack.push_back(Frame((inKey == true) ? NULL : &node, size, isMap, this->cur_.pArena));
+    this->next();
+}
+
+
+void MsgPack::VariantBuilder::complete() {
+    std::vector<Frame>& stack = this->msgpack_.stack_;
+    if (stack.empty() == true) {
+        this->pTarget_ = NULL;
+        return;
+    }
+
+    Frame& frame = stack.back();
+    if (frame.inKey == true) {
+        frame.inKey = false;
+        this->pTarget_ = &(this->frameNode(stack.size() - 1)[std::move(frame.key)]);
+        if (this->pTarget_->type() != Variant::NONE) {
+            // duplicated key: the later value wins
+            *(this->pTarget_) = Variant(this->cur_.pArena);
+        }
+        return;
+    }
+    this->next();
+}
+
+
+void MsgPack::VariantBuilder::next() {
+    std::vector<Frame>& stack = this->msgpack_.stack_;
+    Frame& frame = stack.back();
+    if (frame.remaining == 0) {
+        this->pTarget_ = NULL;
+        return;
+    }
+
+    --(frame.remaining);
+    if (frame.isMap == true) {
+        frame.inKey = true;
+        frame.key.reset(this->cur_.pArena);
+        this->pTarget_ = &(frame.key);
+    } else {
+        this->pTarget_ = &(this->frameNode(stack.size() - 1).emplace_back());
+    }
+}
+
+
+int MsgPack::unpack_positiveFixNum(unsigned char c) {
+    return (c & 127);
+}
+
+
+int MsgPack::unpack_negativeFixNum(unsigned char c) {
+    // 111xxxxx: 5-bit negative integer (-32 .. -1)
+    return static_cast<int>(c) - 256;
+}
+
+
+bool MsgPack::unpack_timestamp(const char* p, const std::size_t size, INT64& seconds, UINT32& nanoseconds) {
+    if (size == 4) {
+        // timestamp 32: unsigned seconds
+        seconds = load_be32(p);
+    } else if (size == 8) {
+        // timestamp 64: 30-bit nanoseconds and 34-bit unsigned seconds
+        const UINT64 value = load_be64(p);
+        nanoseconds = static_cast<UINT32>(value >> 34);
+        seconds = static_cast<INT64>(value & 0x00000003ffffffffULL);
+    } else if (size == 12) {
+        // timestamp 96: nanoseconds and signed seconds
+        nanoseconds = load_be32(p);
+        seconds = static_cast<INT64>(load_be64(p + 4));
+    } else {
+        return false;
+    }
+
+    // out of range values are kept as they are
+    return (nanoseconds <= 999999999u);
+}
+
+
+MsgPack::UINT8 MsgPack::unpack_uint8(Cursor& cur) {
+    UINT8 value = 0;
+    if (cur.require(1) == true) {
+        value = static_cast<UINT8>(*(cur.p));
+        ++(cur.p);
+    }
+
+    return value;
+}
+
+
+MsgPack::UINT16 MsgPack::unpack_uint16(Cursor& cur) {
+    UINT16 value = 0;
+    if (cur.require(2) == true) {
+        value = load_be16(cur.p);
+        cur.p += 2;
+    }
+
+    return value;
+}
+
+
+MsgPack::UINT32 MsgPack::unpack_uint32(Cursor& cur) {
+    UINT32 value = 0;
+    if (cur.require(4) == true) {
+        value = load_be32(cur.p);
+        cur.p += 4;
+    }
+
+    return value;
+}
+
+
+MsgPack::UINT64 MsgPack::unpack_uint64(Cursor& cur) {
+    UINT64 value = 0;
+    if (cur.require(8) == true) {
+        value = load_be64(cur.p);
+        cur.p += 8;
+    }
+
+    return value;
+}
+
+
+MsgPack::INT8 MsgPack::unpack_int8(Cursor& cur) {
+    return static_cast<INT8>(this->unpack_uint8(cur));
+}
+
+
+MsgPack::INT16 MsgPack::unpack_int16(Cursor& cur) {
+    return static_cast<INT16>(this->unpack_uint16(cur));
+}
+
+
+MsgPack::INT32 MsgPack::unpack_int32(Cursor& cur) {
+    return static_cast<INT32>(this->unpack_uint32(cur));
+}
+
+
+MsgPack::INT64 MsgPack::unpack_int64(Cursor& cur) {
+    return static_cast<INT64>(this->unpack_uint64(cur));
+}
+
+
+float MsgPack::unpack_float(Cursor& cur) {
+    assert(sizeof(float) == 4);
+    const UINT32 bits = this->unpack_uint32(cur);
+    float value;
+    std::memcpy(&value, &bits, 4);
+
+    return value;
+}
+
+double MsgPack::unpack_double(Cursor& cur)
+{
+    assert(sizeof(double) == 8);
+    const UINT64 bits = this->unpack_uint64(cur);
+    double value;
+    std::memcpy(&value, &bits, 8);
+
+    return value;
+}
+
+
+bool MsgPack::unpackSelected(const char* pData, const std::size_t size,
+                             const std::vector<std::string>& paths, VariantArena* pArena) {
+    std::vector<std::vector<std::string> > suffixes;
+    for (std::vector<std::string>::const_iterator p = paths.begin(); p != paths.end(); ++p) {
+        std::vector<std::string> names;
+        std::size_t begin = 0;
+        while (begin <= p->size()) {
+            std::size_t end = p->find('/', begin);
+            if (end == std::string::npos) {
+                end = p->size();
+            }
+            if (end > begin) {
+                names.push_back(p->substr(begin, end - begin));
+            }
+            begin = end + 1;
+        }
+        suffixes.push_back(names);
+    }
+
+    // node 0 is the root; 0 also means "no child", which the root never is
+    std::vector<PathNode> nodes;
+    buildPathNode(suffixes, 0, nodes);
+
+    Cursor cur(pData, pData + size, pArena);
+    Variant ans(pArena);
+    if (nodes[0].leaf == true) {
+        ans = this->loadBinary(cur);
+    } else if (cur.require(1) == true) {
+        this->loadSelected(cur, nodes, 0, 0, ans);
+    }
+
+    this->data_.reset(pArena);
+    this->data_ = std::move(ans);
+    return cur.good;
+}
+
+
+std::size_t MsgPack::buildPathNode(const std::vector<std::vector<std::string> >& suffixes,
+                                   const std::size_t depth, std::vector<PathNode>& nodes) {
+    const std::size_t index = nodes.size();
+    nodes.push_back(PathNode());
+
+    std::vector<std::vector<std::string> > wildcard;
+    std::vector<std::string> names;
+    for (std::vector<std::vector<std::string> >::const_iterator p = suffixes.begin(); p != suffixes.end(); ++p) {
+        if (p->size() == depth) {
+            nodes[index].leaf = true;
+            return index;
+        } else if ((*p)[depth] == "*") {
+            wildcard.push_back(*p);
+        } else if (std::find(names.begin(), names.end(), (*p)[depth]) == names.end()) {
+            names.push_back((*p)[depth]);
+        }
+    }
+
+    for (std::vector<std::string>::const_iterator name = names.begin(); name != names.end(); ++name) {
+        std::vector<std::vector<std::string> > selected = wildcard;
+        for (std::vector<std::vector<std::string> >::const_iterator p = suffixes.begin(); p != suffixes.end(); ++p) {
+            if ((*p)[depth] == *name) {
+                selected.push_back(*p);
+            }
+        }
+        // nodes may move while the child is built
+        const std::size_t child = buildPathNode(selected, depth + 1, nodes);
+        nodes[index].children.push_back(std::make_pair(*name, child));
+
+        // only the canonical decimal form ("7", not "07") selects an element
+        bool isIndex = ((name->empty() != true) && (name->size() <= 19) &&
+                        ((name->size() == 1) || ((*name)[0] != '0')));
+        UINT64 i = 0;
+        for (std::string::const_iterator p = name->begin(); (isIndex == true) && (p != name->end()); ++p) {
+            isIndex = ((*p >= '0') && (*p <= '9'));
+            i = i * 10 + static_cast<UINT64>(*p - '0');
+        }
+        if (isIndex == true) {
+            nodes[index].indices.push_back(std::make_pair(i, child));
+        }
+    }
+    std::sort(nodes[index].indices.begin(), nodes[index].indices.end());
+    if (wildcard.empty() != true) {
+        const std::size_t child = buildPathNode(wildcard, depth + 1, nodes);
+        nodes[index].wildcard = child;
+    }
+    return index;
+}
+
+
+bool MsgPack::loadSelected(Cursor& cur, const std::vector<PathNode>& nodes, const std::size_t node,
+                           const std::size_t depth, Variant& out) {
+    const PathNode& path = nodes[node];
+    if (path.leaf == true) {
+        out = this->loadBinary(cur);
+        return cur.good;
+    }
+
+    const unsigned char c = static_cast<unsigned char>(*(cur.p));
+    const bool isMap = (((c >= 0x80) && (c <= 0x8f)) || (c == 0xde) || (c == 0xdf));
+    const bool isArray = (((c >= 0x90) && (c <= 0x9f)) || (c == 0xdc) || (c == 0xdd));
+    if ((isMap != true) && (isArray != true)) {
+        skipObject(cur);
+        return false;
+    }
+
+    UINT64 bodySize = 0;
+    UINT64 children = 0;
+    const std::size_t headerSize = scanHeader(cur.p, cur.end - cur.p, bodySize, children);
+    if ((cur.require(headerSize) != true) || (depth >= this->maxDepth_)) {
+        cur.p = cur.end;
+        cur.good = false;
+        return false;
+    }
+    cur.p += headerSize;
+
+    bool found = false;
+    const UINT64 count = (isMap == true) ? (children / 2) : children;
+    for (UINT64 i = 0; (i < count) && (cur.require(1) == true); ++i) {
+        // the child of the key (or index); a wildcard is the fallback
+        std::size_t child = path.wildcard;
+        Variant key(cur.pArena);
+        if (isMap == true) {
+            const char* pKey = NULL;
+            std::size_t keySize = 0;
+            const unsigned char k = static_cast<unsigned char>(*(cur.p));
+            const bool isStr = (((k >= 0xa0) && (k <= 0xbf)) || ((k >= 0xd9) && (k <= 0xdb)));
+            if (isStr == true) {
+                const std::size_t keyHeader = scanHeader(cur.p, cur.end - cur.p, bodySize, children);
+                if ((static_cast<std::size_t>(cur.end - cur.p) >= keyHeader) &&
+                    (static_cast<std::size_t>(cur.end - cur.p) - keyHeader >= bodySize)) {
+                    pKey = cur.p + keyHeader;
+                    keySize = static_cast<std::size_t>(bodySize);
+                }
+            }
+            for (std::size_t j = 0; (pKey != NULL) && (j < path.children.size()); ++j) {
+                const std::string& name = path.children[j].first;
+                if ((name.size() == keySize) && (std::memcmp(name.data(), pKey, keySize) == 0)) {
+                    child = path.children[j].second;
+                    break;
+                }
+            }
+
+            if (child != 0) {
+                key = this->loadBinary(cur);
+            } else {
+                skipObject(cur);
+            }
+        } else {
+            const std::vector<std::pair<UINT64, std::size_t> >::const_iterator p =
+                std::lower_bound(path.indices.begin(), path.indices.end(), std::make_pair(i, std::size_t(0)));
+            if ((p != path.indices.end()) && (p->first == i)) {
+                child = p->second;
+            }
+        }
+
+        if ((child == 0) || (cur.good != true) || (cur.require(1) != true)) {
+            skipObject(cur);
+            continue;
+        }
+
+        Variant value(cur.pArena);
+        if (this->loadSelected(cur, nodes, child, depth + 1, value) != true) {
+            continue;
+        }
+        if (found != true) {
+            out = Variant(cur.pArena, (isMap == true) ? Variant::MAP : Variant::ARRAY);
+            found = true;
+        }
+        if (isMap == true) {
+            out[std::move(key)] = std::move(value);
+        } else {
+            out.resize(static_cast<std::size_t>(i) + 1);
+            out.getAt(static_cast<std::size_t>(i)) = std::move(value);
+        }
+    }
+    return (found && cur.good);
+}
+
+
+void MsgPack::skipObject(Cursor& cur) {
+    std::size_t pos = cur.p - cur.begin;
+    UINT64 remaining = 1;
+    if (scanObject(cur.begin, cur.end - cur.begin, pos, remaining) != SCAN_COMPLETE) {
+        cur.p = cur.end;
+        cur.good = false;
+        return;
+    }
+    cur.p = cur.begin + pos;
+}
+
+
+bool MsgPack::unpackParallel(const char* pData, const std::size_t size, const unsigned int threads) {
+    UINT64 bodySize = 0;
+    UINT64 children = 0;
+    const unsigned char c = (size > 0) ? static_cast<unsigned char>(pData[0]) : 0;
+    const bool isArray = (((c >= 0x90) && (c <= 0x9f)) || (c == 0xdc) || (c == 0xdd));
+    const std::size_t headerSize = (size > 0) ? scanHeader(pData, size, bodySize, children) : 0;
+    if ((isArray != true) || (headerSize == 0) || (size < headerSize)) {
+        return this->unpack(pData, size);
+    }
+
+    return this->decodeParallel(pData, headerSize, size, children, false, threads);
+}
+
+
+bool MsgPack::unpackStreamParallel(const char* pData, const std::size_t size, const unsigned int threads) {
+    return this->decodeParallel(pData, 0, size, 0, true, threads);
+}
+
+
+bool MsgPack::decodeParallel(const char* pData, const std::size_t begin, const std::size_t end,
+                             const UINT64 count, const bool stream, unsigned int threads) {
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // a few tasks per thread so that a slow range does not hold the others
+    struct Task {
+        std::size_t begin;
+        std::size_t end;
+        std::size_t first;   // index of the first element
+    };
+    const std::size_t taskBytes = std::max<std::size_t>((end - begin) / (threads * 4), 1);
+
+    // structural pass: find element boundaries without decoding
+    std::vector<Task> tasks;
+    Task task = { begin, begin, 0 };
+    std::size_t pos = begin;
+    std::size_t n = 0;
+    bool good = true;
+    while (stream ? (pos < end) : (n < count)) {
+        // pos stays at the end of the last complete element on failure
+        std::size_t next = pos;
+        UINT64 remaining = 1;
+        if (scanObject(pData, end, next, remaining) != SCAN_COMPLETE) {
+            good = false;
+            break;
+        }
+        pos = next;
+        ++n;
+        if (pos - task.begin >= taskBytes) {
+            task.end = pos;
+            tasks.push_back(task);
+            task.begin = pos;
+            task.first = n;
+        }
+    }
+    if (pos > task.begin) {
+        task.end = pos;
+        tasks.push_back(task);
+    }
+
+    Variant ans(Variant::ARRAY);
+    ans.resize(n);
+
+    // each task writes only its own elements, so no locking is needed
+    std::atomic<std::size_t> nextTask(0);
+    std::atomic<bool> decoded(true);
+    auto worker = [&]() {
+        // loadBinary keeps its work area in the object
+        MsgPack decoder;
+        decoder.setMaxDepth(this->maxDepth_);
+        decoder.setStringView(this->stringView_);
+        for (std::size_t i = nextTask++; i < tasks.size(); i = nextTask++) {
+            Cursor cur(pData + tasks[i].begin, pData + tasks[i].end);
+            for (std::size_t j = tasks[i].first; cur.p < cur.end; ++j) {
+                ans.getAt(j) = decoder.loadBinary(cur);
+            }
+            if (cur.good != true) {
+                decoded = false;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    const std::size_t poolSize = std::min<std::size_t>(threads, tasks.size());
+    for (std::size_t i = 1; i < poolSize; ++i) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::size_t i = 0; i < pool.size(); ++i) {
+        pool[i].join();
+    }
+
+    this->data_.reset();
+    this->data_ = std::move(ans);
+    return (good && decoded);
+}
+
+
+std::size_t MsgPack::scanHeader(const char* p, const std::size_t size, UINT64& bodySize, UINT64& children) {
+    const unsigned char c = static_cast<unsigned char>(*p);
+    if ((c <= 0x7f) || (c >= 0xe0)) {
+        // positive/negative fixint
+        bodySize = 0;
+        children = 0;
+        return 1;
+    } else if (c <= 0x8f) {
+        bodySize = 0;
+        children = 2 * UINT64(c & 0x0f);
+        return 1;
+    } else if (c <= 0x9f) {
+        bodySize = 0;
+        children = c & 0x0f;
+        return 1;
+    } else if (c <= 0xbf) {
+        bodySize = c & 0x1f;
+        children = 0;
+        return 1;
+    }
+
+    // header size without the body
+    static const unsigned char HEADER_SIZE[0xe0 - 0xc0] = {
+        1, 0, 1, 1, 2, 3, 5, 3,     // nil, (never used), false, true, bin8/16/32, ext8
+        4, 6, 5, 9, 2, 3, 5, 9,     // ext16/32, float32/64, uint8/16/32/64
+        2, 3, 5, 9, 3, 4, 6, 10,    // int8/16/32/64, fixext1/2/4/8
+        18, 2, 3, 5, 3, 5, 3, 5     // fixext16, str8/16/32, array16/32, map16/32
+    };
+    const std::size_t headerSize = HEADER_SIZE[c - 0xc0];
+    if ((headerSize == 0) || (size < headerSize)) {
+        return headerSize;
+    }
+
+    bodySize = 0;
+    children = 0;
+    switch (c) {
+    case 0xc4:  // bin 8
+    case 0xd9:  // str 8
+        bodySize = static_cast<unsigned char>(p[1]);
+        break;
+    case 0xc5:  // bin 16
+    case 0xda:  // str 16
+        bodySize = load_be16(p + 1);
+        break;
+    case 0xc6:  // bin 32
+    case 0xdb:  // str 32
+        bodySize = load_be32(p + 1);
+        break;
+    case 0xc7:  // ext 8
+        bodySize = static_cast<unsigned char>(p[1]);
+        break;
+    case 0xc8:  // ext 16
+        bodySize = load_be16(p + 1);
+        break;
+    case 0xc9:  // ext 32
+        bodySize = load_be32(p + 1);
+        break;
+    case 0xdc:  // array 16
+        children = load_be16(p + 1);
+        break;
+    case 0xdd:  // array 32
+        children = load_be32(p + 1);
+        break;
+    case 0xde:  // map 16
+        children = 2 * UINT64(load_be16(p + 1));
+        break;
+    case 0xdf:  // map 32
+        children = 2 * UINT64(load_be32(p + 1));
+        break;
+    default:
+        break;
+    }
+    return headerSize;
+}
+
+
+MsgPack::ScanResult MsgPack::scanObject(const char* p, const std::size_t size,
+                                        std::size_t& pos, UINT64& remaining) {
+    // one counter is enough: a container replaces itself by its children
+    while (remaining > 0) {
+        if (pos >= size) {
+            return SCAN_INCOMPLETE;
+        }
+
+        UINT64 bodySize = 0;
+        UINT64 children = 0;
+        const std::size_t headerSize = scanHeader(p + pos, size - pos, bodySize, children);
+        if (headerSize == 0) {
+            return SCAN_INVALID;
+        } else if (size - pos < headerSize) {
+            return SCAN_INCOMPLETE;
+        }
+
+        pos += headerSize + static_cast<std::size_t>(bodySize);
+        remaining += children;
+        --remaining;
+    }
+
+    return (pos <= size) ? SCAN_COMPLETE : SCAN_INCOMPLETE;
+}
+
+
+bool MsgPack::scan(const char* pData, const std::size_t size, ScanInfo& info, std::size_t maxDepth) {
+    if (maxDepth > DEFAULT_MAX_DEPTH) {
+        maxDepth = DEFAULT_MAX_DEPTH;
+    }
+
+    // elements left in each open container, kept on the stack to avoid allocation
+    UINT64 levels[DEFAULT_MAX_DEPTH];
+    std::size_t depth = 0;
+    std::size_t pos = 0;
+    info = ScanInfo();
+
+    do {
+        info.offset = pos;
+        if (pos >= size) {
+            info.error = SCAN_ERROR_TRUNCATED;
+            return false;
+        }
+
+        UINT64 bodySize = 0;
+        UINT64 children = 0;
+        const std::size_t headerSize = scanHeader(pData + pos, size - pos, bodySize, children);
+        if (headerSize == 0) {
+            info.error = SCAN_ERROR_INVALID;
+            return false;
+        } else if ((size - pos < headerSize) || (size - pos - headerSize < bodySize)) {
+            info.error = SCAN_ERROR_TRUNCATED;
+            return false;
+        }
+
+        const unsigned char c = static_cast<unsigned char>(pData[pos]);
+        const bool isContainer = (((c >= 0x80) && (c <= 0x9f)) || ((c >= 0xdc) && (c <= 0xdf)));
+        pos += headerSize + static_cast<std::size_t>(bodySize);
+
+        if (isContainer == true) {
+            if (depth >= maxDepth) {
+                info.error = SCAN_ERROR_TOO_DEEP;
+                return false;
+            }
+            if (depth == 0) {
+                const bool isMap = ((c <= 0x8f) || (c >= 0xde));
+                info.count = (isMap == true) ? (children / 2) : children;
+            }
+            info.depth = std::max(info.depth, depth + 1);
+            if (children > 0) {
+                levels[depth] = children;
+                ++depth;
+                continue;
+            }
+        }
+
+        // the element is complete: close every container it completes
+        while ((depth > 0) && (--levels[depth - 1] == 0)) {
+            --depth;
+        }
+    } while (depth > 0);
+
+    info.offset = 0;
+    info.size = pos;
+    return true;
+}
+
+
+void MsgPack::save(const std::string& path) const {
+    const std::string buf = this->packer();
+
+    std::ofstream ofs;
+    ofs.open(path.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    ofs.write(buf.data(), buf.size());
+    ofs.close();
+}
+
+
+std::string MsgPack::packer() const {
+    std::string ans(this->encodedSize(), '\0');
+    if (ans.empty() != true) {
+        RawBuffer out(&ans[0]);
+        this->packer(out);
+    }
+    return ans;
+}
+
+
+std::size_t MsgPack::packer(char* pOut, const std::size_t capacity) const {
+    const std::size_t size = this->encodedSize();
+    if (size > capacity) {
+        return 0;
+    }
+
+    RawBuffer out(pOut);
+    this->packer(out);
+    return size;
+}
+
+
+std::size_t MsgPack::encodedSize(const Variant& data) const {
+    SizeCounter counter;
+    this->pack(data, counter);
+    return counter.size;
+}
+
+
+void MsgPack::packerParallel(std::vector<std::string>& pieces, unsigned int threads) const {
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    pieces.assign(1, std::string());
+    const Variant::DataType type = this->data_.type();
+    const std::size_t count = this->data_.size();
+    if ((threads <= 1) || (count < 2) || ((type != Variant::ARRAY) && (type != Variant::MAP))) {
+        this->packer(pieces[0]);
+        return;
+    }
+
+    if (type == Variant::ARRAY) {
+        this->pack_array_header(count, pieces[0]);
+        this->packChildren(this->data_.beginArray(), count, threads, pieces);
+    } else {
+        this->pack_map_header(count, pieces[0]);
+        this->packChildren(this->data_.beginMap(), count, threads, pieces);
+    }
+}
+
+
+std::string MsgPack::packerParallel(const unsigned int threads) const {
+    std::vector<std::string> pieces;
+    this->packerParallel(pieces, threads);
+    if (pieces.size() == 1) {
+        return std::move(pieces[0]);
+    }
+
+    std::size_t size = 0;
+    for (std::size_t i = 0; i < pieces.size(); ++i) {
+        size += pieces[i].size();
+    }
+    std::string ans;
+    ans.reserve(size);
+    for (std::size_t i = 0; i < pieces.size(); ++i) {
+        ans.append(pieces[i]);
+    }
+    return ans;
+}
+
+
+template<typename Iterator>
+void MsgPack::packChildren(Iterator begin, const std::size_t count, const unsigned int threads,
+                           std::vector<std::string>& pieces) const {
+    // a few tasks per thread so that a slow range does not hold the others
+    const std::size_t taskCount = std::min<std::size_t>(count, std::size_t(threads) * 4);
+
+    // the first element of each task; only the iterators are walked here
+    std::vector<Iterator> starts;
+    starts.reserve(taskCount);
+    Iterator p = begin;
+    for (std::size_t i = 0, n = 0; i < taskCount; ++i) {
+        const std::size_t first = count * i / taskCount;
+        for (; n < first; ++n) {
+            ++p;
+        }
+        starts.push_back(p);
+    }
+
+    // each task writes only its own piece, so no locking is needed
+    pieces.resize(taskCount + 1);
+    std::atomic<std::size_t> nextTask(0);
+    auto worker = [&]() {
+        for (std::size_t i = nextTask++; i < taskCount; i = nextTask++) {
+            const std::size_t n = count * (i + 1) / taskCount - count * i / taskCount;
+            std::string& out = pieces[i + 1];
+            Iterator q = starts[i];
+            for (std::size_t j = 0; j < n; ++j, ++q) {
+                this->pack_element(q, out);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    const std::size_t poolSize = std::min<std::size_t>(threads, taskCount);
+    for (std::size_t i = 1; i < poolSize; ++i) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::size_t i = 0; i < pool.size(); ++i) {
+        pool[i].join();
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const Variant& data, Buffer& out) const {
+    switch (data.type()) {
+    case Variant::ARRAY:
+        this->pack_array(data, out);
+        break;
+
+    case Variant::MAP:
+        this->pack_map(data, out);
+        break;
+
+    default:
+        this->pack_scalar(data, out);
+        break;
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_scalar(const Variant& data, Buffer& out) const {
+    switch (data.type()) {
+    case Variant::BOOLEAN:
+        this->pack(data.get_bool(), out);
+        break;
+
+    case Variant::STRING:
+        this->pack_str(data.str_data(), data.str_size(), out);
+        break;
+
+    case Variant::INT:
+        if (this->compact_ == true) {
+            this->pack_int(data.get_int(), out);
+        } else {
+            int value = data.get_int();
+#if COMPILE_VALUE_SIZEOF_INT == 4
+            this->pack_int32(value, out);
+#else
+            this->pack_int64(value, out);
+#endif
+        }
+        break;
+
+    case Variant::LONG:
+        if (this->compact_ == true) {
+            this->pack_int(data.get_long(), out);
+        } else {
+            long value = data.get_long();
+#if COMPILE_VALUE_SIZEOF_LONG == 4
+            this->pack_int32(value, out);
+#else
+            this->pack_int64(value, out);
+#endif
+        }
+        break;
+
+    case Variant::UINT:
+        if (this->compact_ == true) {
+            this->pack_uint(data.get_uint(), out);
+        } else {
+            unsigned int value = data.get_uint();
+#if COMPILE_VALUE_SIZEOF_INT == 4
+            this->pack_uint32(value, out);
+#else
+            this->pack_uint64(value, out);
+#endif
+        }
+        break;
+
+    case Variant::ULONG:
+        if (this->compact_ == true) {
+            this->pack_uint(data.get_ulong(), out);
+        } else {
+            unsigned long value = data.get_ulong();
+#if COMPILE_VALUE_SIZEOF_LONG == 4
+            this->pack_uint32(value, out);
+#else
+            this->pack_uint64(value, out);
+#endif
+        }
+        break;
+
+    case Variant::DOUBLE:
+        {
+            double value = data.get_double();
+            this->pack(value, out);
+        }
+        break;
+
+    case Variant::NONE:
+        this->write(out, char(0xc0));
+        break;
+
+    case Variant::BINARY:
+        this->pack_bin(data.str_data(), data.str_size(), out);
+        break;
+
+    case Variant::EXT:
+        this->pack_ext(data.ext_type(), data.str_data(), data.str_size(), out);
+        break;
+
+    case Variant::TIMESTAMP:
+        this->pack_timestamp(data.timestamp_sec(), data.timestamp_nsec(), out);
+        break;
+
+    default:
+        // something wrong.
+        abort();
+        break;
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_array(const Variant& data, Buffer& out) const {
+    assert(data.type() == Variant::ARRAY);
+
+    this->pack_array_header(data.size(), out);
+
+    for (Variant::ArrayConstIterator p = data.beginArray(); p != data.endArray(); ++p) {
+        this->pack(*p, out);
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_map(const Variant& data, Buffer& out) const {
+    assert(data.type() == Variant::MAP);
+
+    this->pack_map_header(data.size(), out);
+
+    for (Variant::MapConstIterator p = data.beginMap(); p != data.endMap(); ++p) {
+        this->pack(p->first, out);
+        this->pack(p->second, out);
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const bool value, Buffer& out) const {
+    if (value == true) {
+        this->write(out, char(0xc3));
+    } else {
+        this->write(out, char(0xc2));
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const UINT8 value, Buffer& out) const {
+    this->write(out, char(0xcc));
+    this->write(out, char(value));
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const UINT16 value, Buffer& out) const {
+    this->write(out, char(0xcd));
+    this->write_be16(out, value);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_uint32(const UINT32 value, Buffer& out) const {
+    this->write(out, char(0xce));
+    this->write_be32(out, value);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_uint64(const UINT64 value, Buffer& out) const {
+    this->write(out, char(0xcf));
+    this->write_be64(out, value);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const INT8 value, Buffer& out) const {
+    this->write(out, char(0xd0));
+    this->write(out, char(value));
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const INT16 value, Buffer& out) const {
+    this->write(out, char(0xd1));
+    this->write_be16(out, UINT16(value));
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_int32(const INT32 value, Buffer& out) const {
+    this->write(out, char(0xd2));
+    this->write_be32(out, UINT32(value));
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_int64(const INT64 value, Buffer& out) const {
+    this->write(out, char(0xd3));
+    this->write_be64(out, UINT64(value));
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const double value, Buffer& out) const {
+    assert(sizeof(double) == 8);
+    UINT64 bits;
+    std::memcpy(&bits, &value, 8);
+
+    this->write(out, char(0xcb));
+    this->write_be64(out, bits);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack(const std::string& str, Buffer& out) const {
+    this->pack_str(str.data(), str.length(), out);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_str(const char* pStr, const UINT32 size, Buffer& out) const {
+    this->pack_str_header(size, out);
+    out.append(pStr, sizeof(char) * size);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_bin(const char* pData, const UINT32 size, Buffer& out) const {
+    this->pack_bin_header(size, out);
+    out.append(pData, size);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_ext(const INT8 type, const char* pData, const UINT32 size, Buffer& out) const {
+    this->pack_ext_header(type, size, out);
+    out.append(pData, size);
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_timestamp(const INT64 seconds, const UINT32 nanoseconds, Buffer& out) const {
+    if ((this->compact_ == true) && ((seconds >> 34) == 0)) {
+        if ((nanoseconds == 0) && (seconds <= 0xffffffffLL)) {
+            // timestamp 32
+            this->write(out, char(0xd6));
+            this->write(out, char(TIMESTAMP_TYPE));
+            this->write_be32(out, UINT32(seconds));
+        } else {
+            // timestamp 64
+            this->write(out, char(0xd7));
+            this->write(out, char(TIMESTAMP_TYPE));
+            this->write_be64(out, (UINT64(nanoseconds) << 34) | UINT64(seconds));
+        }
+    } else {
+        // timestamp 96
+        this->write(out, char(0xc7));
+        this->write(out, char(12));
+        this->write(out, char(TIMESTAMP_TYPE));
+        this->write_be32(out, nanoseconds);
+        this->write_be64(out, UINT64(seconds));
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_int(const INT64 value, Buffer& out) const {
+    if (value >= 0) {
+        this->pack_uint(UINT64(value), out);
+    } else if (value >= -32) {
+        // negative fixint
+        this->write(out, char(value));
+    } else if (value >= std::numeric_limits<INT8>::min()) {
+        this->pack(INT8(value), out);
+    } else if (value >= std::numeric_limits<INT16>::min()) {
+        this->pack(INT16(value), out);
+    } else if (value >= std::numeric_limits<INT32>::min()) {
+        this->pack_int32(INT32(value), out);
+    } else {
+        this->pack_int64(value, out);
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_uint(const UINT64 value, Buffer& out) const {
+    if (value <= 0x7f) {
+        // positive fixint
+        this->write(out, char(value));
+    } else if (value <= std::numeric_limits<UINT8>::max()) {
+        this->pack(UINT8(value), out);
+    } else if (value <= std::numeric_limits<UINT16>::max()) {
+        this->pack(UINT16(value), out);
+    } else if (value <= std::numeric_limits<UINT32>::max()) {
+        this->pack_uint32(UINT32(value), out);
+    } else {
+        this->pack_uint64(value, out);
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_str_header(const UINT32 size, Buffer& out) const {
+    if (this->compact_ != true) {
+        this->write(out, char(0xdb));
+        this->write_be32(out, size);
+    } else if (size < 32) {
+        this->write(out, char(0xa0 | size));
+    } else if (size <= std::numeric_limits<UINT8>::max()) {
+        this->write(out, char(0xd9));
+        this->write(out, char(size));
+    } else if (size <= std::numeric_limits<UINT16>::max()) {
+        this->write(out, char(0xda));
+        this->write_be16(out, UINT16(size));
+    } else {
+        this->write(out, char(0xdb));
+        this->write_be32(out, size);
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_bin_header(const UINT32 size, Buffer& out) const {
+    if (this->compact_ != true) {
+        this->write(out, char(0xc6));
+        this->write_be32(out, size);
+    } else if (size <= std::numeric_limits<UINT8>::max()) {
+        this->write(out, char(0xc4));
+        this->write(out, char(size));
+    } else if (size <= std::numeric_limits<UINT16>::max()) {
+        this->write(out, char(0xc5));
+        this->write_be16(out, UINT16(size));
+    } else {
+        this->write(out, char(0xc6));
+        this->write_be32(out, size);
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_ext_header(const INT8 type, const UINT32 size, Buffer& out) const {
+    if (this->compact_ != true) {
+        this->write(out, char(0xc9));
+        this->write_be32(out, size);
+    } else if (size == 1) {
+        this->write(out, char(0xd4));
+    } else if (size == 2) {
+        this->write(out, char(0xd5));
+    } else if (size == 4) {
+        this->write(out, char(0xd6));
+    } else if (size == 8) {
+        this->write(out, char(0xd7));
+    } else if (size == 16) {
+        this->write(out, char(0xd8));
+    } else if (size <= std::numeric_limits<UINT8>::max()) {
+        this->write(out, char(0xc7));
+        this->write(out, char(size));
+    } else if (size <= std::numeric_limits<UINT16>::max()) {
+        this->write(out, char(0xc8));
+        this->write_be16(out, UINT16(size));
+    } else {
+        this->write(out, char(0xc9));
+        this->write_be32(out, size);
+    }
+    this->write(out, char(type));
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_array_header(const UINT32 size, Buffer& out) const {
+    if (this->compact_ != true) {
+        this->write(out, char(0xdd));
+        this->write_be32(out, size);
+    } else if (size < 16) {
+        this->write(out, char(0x90 | size));
+    } else if (size <= std::numeric_limits<UINT16>::max()) {
+        this->write(out, char(0xdc));
+        this->write_be16(out, UINT16(size));
+    } else {
+        this->write(out, char(0xdd));
+        this->write_be32(out, size);
+    }
+}
+
+
+template<typename Buffer>
+void MsgPack::pack_map_header(const UINT32 size, Buffer& out) const {
+    if (this->compact_ != true) {
+        this->write(out, char(0xdf));
+        this->write_be32(out, size);
+    } else if (size < 16) {
+        this->write(out, char(0x80 | size));
+    } else if (size <= std::numeric_limits<UINT16>::max()) {
+        this->write(out, char(0xde));
+        this->write_be16(out, UINT16(size));
+    } else {
+        this->write(out, char(0xdf));
+        this->write_be32(out, size);
+    }
+}
+
+
+
+/// 分割して届く MsgPack 形式のデータを順にデコードする
+///
+/// feed で受け取ったデータから、要素が完成するたびに Variant を作る。
+/// 完成した要素は受け取ったバッファから直接デコードし、
+/// 途中で途切れた1要素分だけを次の feed まで保持する。
+class MsgPackDecoder {
+public:
+    /// @param[in] pArena デコードしたデータのメモリ確保先 (NULL の場合はヒープ)
+    explicit MsgPackDecoder(VariantArena* pArena = NULL);
+
+public:
+    /// 続きのデータを渡す
+    ///
+    /// @param[in] pData データの先頭
+    /// @param[in] size  データのバイト数
+    /// @retval true  成功した
+    /// @retval false データが不正 (以後の feed はすべて失敗する)
+    bool feed(const char* pData, std::size_t size);
+
+    /// デコードが終わった要素を先頭から1つ取り出す
+    ///
+    /// @param[out] value 取り出した要素
+    /// @retval true  取り出した
+    /// @retval false 取り出せる要素がない
+    bool next(Variant& value);
+
+    /// 取り出せる要素の数
+    std::size_t available() const {
+        return this->ready_.size();
+    }
+
+    /// 保持している途中までの要素のバイト数
+    std::size_t pending() const {
+        return this->buffer_.size();
+    }
+
+    bool good() const {
+        return this->good_;
+    }
+
+    /// MsgPack::setMaxDepth と同じ
+    void setMaxDepth(std::size_t depth) {
+        this->msgpack_.setMaxDepth(depth);
+    }
+
+    /// 途中までのデータと取り出していない要素を捨てて最初の状態に戻す
+    void reset();
+
+protected:
+    /// 完成した要素をデコードして ready_ に加える
+    bool emit(const char* pData, std::size_t size);
+
+protected:
+    MsgPack msgpack_;
+    VariantArena* pArena_;
+    std::deque<Variant> ready_;
+
+    /// 途中で途切れた要素のデータと、その読み飛ばしの途中経過
+    std::vector<char> buffer_;
+    std::size_t pos_;
+    MsgPack::UINT64 remaining_;
+
+    bool good_;
+};
+
+
+/// 連続して並んだ MsgPack 形式の要素 (ログなど) を先頭から1つずつ読む
+///
+/// ファイルは一定の大きさずつ読み込んでデコードするので、
+/// ファイルの大きさによらず使うメモリは一定に収まる。
+class MsgPackReader {
+public:
+    /// @param[in] pArena 読み込んだデータのメモリ確保先 (NULL の場合はヒープ)
+    explicit MsgPackReader(VariantArena* pArena = NULL);
+
+private:
+    MsgPackReader(const MsgPackReader& rhs);
+    MsgPackReader& operator=(const MsgPackReader& rhs);
+
+public:
+    /// ファイル (パイプなども可) を開く
+    ///
+    /// @param[in] path ファイルのパス
+    /// @retval true  開くことができた
+    /// @retval false 開くことができなかった
+    bool open(const std::string& path);
+
+    /// メモリ上のデータを読む (データは読み終わるまで保持しておくこと)
+    ///
+    /// @param[in] pData データの先頭
+    /// @param[in] size  データのバイト数
+    void open(const char* pData, std::size_t size);
+
+    void close();
+
+    /// 次の要素を読む
+    ///
+    /// @param[out] value 読み込んだ要素
+    /// @retval true  読み込んだ
+    /// @retval false 終端に達した、もしくはデータが不正 (good() で区別する)
+    bool next(Variant& value);
+
+    /// データが不正、途中で途切れている、もしくは読み込みに失敗した場合 false
+    bool good() const {
+        return this->good_;
+    }
+
+    /// MsgPack::setMaxDepth と同じ
+    void setMaxDepth(std::size_t depth) {
+        this->msgpack_.setMaxDepth(depth);
+        this->decoder_.setMaxDepth(depth);
+    }
+
+protected:
+    /// ファイルから次のまとまりを読んで decoder_ に渡す
+    ///
+    /// @retval false ファイルの終端に達した、もしくは失敗した
+    bool fill();
+
+protected:
+    MsgPack msgpack_;
+    VariantArena* pArena_;
+
+    // memory
+    const char* p_;
+    const char* pEnd_;
+
+    // file
+    std::ifstream ifs_;
+    MsgPackDecoder decoder_;
+    std::vector<char> chunk_;
+
+    bool good_;
+};
+
+
+/// MsgPack 形式の要素をファイルの末尾に追記する
+///
+/// 書き出しはまとめて行うので、他から読む前に flush() もしくは close() を呼ぶこと。
+class MsgPackAppender {
+public:
+    MsgPackAppender();
+    ~MsgPackAppender();
+
+private:
+    MsgPackAppender(const MsgPackAppender& rhs);
+    MsgPackAppender& operator=(const MsgPackAppender& rhs);
+
+public:
+    /// ファイルを追記用に開く (なければ作る)
+    ///
+    /// @param[in] path ファイルのパス
+    /// @retval true  開くことができた
+    /// @retval false 開くことができなかった
+    bool open(const std::string& path);
+
+    /// @retval false 書き込みに失敗した
+    bool close();
+
+    /// 要素を1つ追記する
+    ///
+    /// @param[in] value 書き出す要素
+    /// @retval false 書き込みに失敗した
+    bool append(const Variant& value);
+
+    /// ためている要素をファイルに書き出す
+    ///
+    /// @retval false 書き込みに失敗した
+    bool flush();
+
+    /// MsgPack::setCompact と同じ
+    void setCompact(bool compact) {
+        this->msgpack_.setCompact(compact);
+    }
+
+protected:
+    MsgPack msgpack_;
+    std::ofstream ofs_;
+    std::string buffer_;
+};
+
+
+/// Variant を作らずに MsgPack 形式の要素をバッファに書き出す
+///
+/// 値は MsgPack::packer と同じ形式 (setCompact に従う) でバッファの末尾に追記する。
+/// ARRAY/MAP はヘッダを書いた後に、要素 (MAP はキーと値を交互に) を
+/// ちょうど size 個書き出すこと (数は確かめない)。
+/// clear() はバッファの領域を残すので、使い回せば確保し直さずに書き出せる。
+class MsgPackWriter {
+public:
+    MsgPackWriter();
+
+public:
+    void pack_nil();
+    void pack_bool(bool value);
+    void pack_int(MsgPack::INT64 value);
+    void pack_uint(MsgPack::UINT64 value);
+    void pack_double(double value);
+    void pack_str(const char* pStr, MsgPack::UINT32 size);
+    void pack_str(const std::string& str);
+    void pack_str(const char* pStr);  // NUL で終わる文字列
+    void pack_bin(const char* pData, MsgPack::UINT32 size);
+    void pack_ext(MsgPack::INT8 type, const char* pData, MsgPack::UINT32 size);
+    void pack_timestamp(MsgPack::INT64 seconds, MsgPack::UINT32 nanoseconds = 0);
+    void pack_array_header(MsgPack::UINT32 size);
+    void pack_map_header(MsgPack::UINT32 size);
+
+    /// Variant を1つ書き出す (要素の一部だけ Variant を使う場合など)
+    void pack(const Variant& value);
+
+    /// 書き出したデータ
+    const std::string& str() const {
+        return this->buffer_;
+    }
+
+    const char* data() const {
+        return this->buffer_.data();
+    }
+
+    std::size_t size() const {
+        return this->buffer_.size();
+    }
+
+    bool empty() const {
+        return this->buffer_.empty();
+    }
+
+    /// 書き出したデータを捨てる (確保した領域は残す)
+    void clear() {
+        this->buffer_.clear();
+    }
+
+    void reserve(std::size_t size) {
+        this->buffer_.reserve(size);
+    }
+
+    /// MsgPack::setCompact と同じ
+    void setCompact(bool compact) {
+        this->msgpack_.setCompact(compact);
+    }
+
+protected:
+    MsgPack msgpack_;
+    std::string buffer_;
+};
+
+
+/// MsgPack 形式のデータの要素の位置を記録し、一部の要素だけを読めるようにする
+///
+/// build でデータを1度読み飛ばし、指定した深さまでの ARRAY の要素と
+/// MAP の値の位置 (オフセットとバイト数) を記録する。find と get は
+/// キーのパスや添字から位置を引き、その要素だけをデコードする。
+/// 索引は save/load でデータとは別のファイルに保存できる。
+/// データが変わった場合は作り直すこと。
+class MsgPackIndex {
+public:
+    MsgPackIndex();
+
+public:
+    /// 索引を作る
+    ///
+    /// @param[in] pData データの先頭
+    /// @param[in] size  データのバイト数
+    /// @param[in] depth 記録する入れ子の深さ (1 の場合は先頭の要素の子まで)
+    /// @retval true  作成した
+    /// @retval false データが不正、もしくは途中で途切れている
+    bool build(const char* pData, std::size_t size, std::size_t depth = 1);
+
+    /// 索引をファイルに書き出す
+    ///
+    /// @param[in] path 出力先
+    /// @retval false 書き込みに失敗した
+    bool save(const std::string& path) const;
+
+    /// save で書き出した索引を読み込む
+    ///
+    /// @param[in] path ファイルのパス
+    /// @retval false ファイルを読めない、索引のファイルではない、
+    ///               もしくは記録した位置が索引やデータの範囲を超えている
+    bool load(const std::string& path);
+
+    void clear();
+
+    /// 要素の位置を探す
+    ///
+    /// path は "/" で区切ったキーの並び ("group1/subgroup1", "items/3/id" など)。
+    /// MAP は文字列のキー、ARRAY は 0 から始まる添字で引く。空の場合は先頭の要素。
+    /// 索引の深さより下はデータを読み飛ばして探す。
+    /// @param[in]  pData  build に渡したデータの先頭
+    /// @param[in]  size   データのバイト数
+    /// @param[in]  path   要素のパス
+    /// @param[out] offset 要素の先頭のオフセット
+    /// @param[out] length 要素のバイト数
+    /// @retval true  見つかった
+    /// @retval false 見つからない、もしくはデータの大きさが索引と異なる
+    bool find(const char* pData, std::size_t size, const std::string& path,
+              std::size_t& offset, std::size_t& length) const;
+
+    /// path の要素だけをデコードする
+    ///
+    /// @param[in]  pData  build に渡したデータの先頭
+    /// @param[in]  size   データのバイト数
+    /// @param[in]  path   要素のパス (find と同じ)
+    /// @param[out] value  デコードした要素
+    /// @param[in]  pArena デコードしたデータのメモリ確保先 (NULL の場合はヒープ)
+    /// @retval true  デコードした
+    /// @retval false 見つからない、もしくはデコードに失敗した
+    bool get(const char* pData, std::size_t size, const std::string& path,
+             Variant& value, VariantArena* pArena = NULL) const;
+
+    /// 記録している要素の数 (先頭の要素を含む)
+    std::size_t size() const {
+        return this->entries_.size();
+    }
+
+    /// 索引を作ったデータのバイト数
+    std::size_t dataSize() const {
+        return static_cast<std::size_t>(this->dataSize_);
+    }
+
+protected:
+    typedef MsgPack::UINT64 UINT64;
+
+    /// 1つの要素の位置
+    struct Entry {
+        UINT64 offset;  ///< 要素の先頭
+        UINT64 size;    ///< 要素のバイト数
+        UINT64 key;     ///< MAP の値の場合はキーの先頭
+        UINT64 hash;    ///< MAP の値の場合は文字列のキーのハッシュ値
+        UINT64 first;   ///< 子の要素の Entry の先頭 (子は連続して並ぶ)
+        UINT64 count;   ///< 記録した子の要素の数
+
+        bool operator<(const Entry& rhs) const {
+            return (this->hash < rhs.hash);
+        }
+    };
+
+    /// entries_[i] の子の要素を記録する
+    void expand(const char* pData, std::size_t i);
+
+    /// offset から始まる要素が文字列なら、その内容を返す
+    static bool loadKey(const char* pData, std::size_t size, std::size_t offset,
+                        const char*& pKey, std::size_t& keySize);
+
+    /// キーのハッシュ値 (FNV-1a、保存するのでプラットフォームに依存しない)
+    static UINT64 hashKey(const char* pKey, std::size_t keySize);
+
+    /// 索引を使わずに、offset の要素の子から name の要素を探す
+    static bool findChild(const char* pData, std::size_t size, const std::string& name,
+                          std::size_t& offset, std::size_t& length);
+
+    /// ARRAY の添字を読む
+    static bool parseIndex(const std::string& name, UINT64& index);
+
+protected:
+    std::vector<Entry> entries_;
+    UINT64 dataSize_;
+    UINT64 depth_;
+};
+
+
+// ========================================================================
+// MsgPackDecoder
+// ========================================================================
+MsgPackDecoder::MsgPackDecoder(VariantArena* pArena)
+    : msgpack_(), pArena_(pArena), ready_(), buffer_(), pos_(0), remaining_(1), good_(true) {
+}
+
+
+bool MsgPackDecoder::feed(const char* pData, std::size_t size) {
+    if (this->good_ != true) {
+        return false;
+    }
+
+    if (this->buffer_.empty() != true) {
+        // finish the buffered object first, appending only the bytes the
+        // scan needs next; the rest of the chunk is then decoded in place
+        for (;;) {
+            std::vector<char>& buffer = this->buffer_;
+            const MsgPack::ScanResult result = MsgPack::scanObject(
+                &(buffer[0]), buffer.size(), this->pos_, this->remaining_);
+            if (result == MsgPack::SCAN_INVALID) {
+                this->good_ = false;
+                return false;
+            } else if (result == MsgPack::SCAN_COMPLETE) {
+                break;
+            } else if (size == 0) {
+                return true;
+            }
+
+            // pos_ is past the end inside a body, or at an unfinished header
+            std::size_t need = 1;
+            if (this->pos_ > buffer.size()) {
+                need = this->pos_ - buffer.size();
+            } else if (this->pos_ < buffer.size()) {
+                MsgPack::UINT64 bodySize = 0;
+                MsgPack::UINT64 children = 0;
+                const std::size_t available = buffer.size() - this->pos_;
+                need = MsgPack::scanHeader(&(buffer[this->pos_]), available, bodySize, children) - available;
+            }
+            const std::size_t used = std::min(need, size);
+            buffer.insert(buffer.end(), pData, pData + used);
+            pData += used;
+            size -= used;
+        }
+
+        if (this->emit(&(this->buffer_[0]), this->pos_) != true) {
+            return false;
+        }
+        this->buffer_.clear();
+        this->pos_ = 0;
+        this->remaining_ = 1;
+    }
+
+    while (size > 0) {
+        const MsgPack::ScanResult result = MsgPack::scanObject(pData, size, this->pos_, this->remaining_);
+        if (result == MsgPack::SCAN_INVALID) {
+            this->good_ = false;
+            return false;
+        } else if (result == MsgPack::SCAN_INCOMPLETE) {
+            // keep only the unfinished object
+            this->buffer_.assign(pData, pData + size);
+            break;
+        }
+
+        if (this->emit(pData, this->pos_) != true) {
+            return false;
+        }
+        pData += this->pos_;
+        size -= this->pos_;
+        this->pos_ = 0;
+        this->remaining_ = 1;
+    }
 
-Variant MsgPack::unpack_ext8(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint8(ifs);
-    return this->unpack_ext(ifs, size);
+    return true;
 }
 
 
-Variant MsgPack::unpack_ext16(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint16(ifs);
-    return this->unpack_ext(ifs, size);
-}
-
+bool MsgPackDecoder::next(Variant& value) {
+    if (this->ready_.empty() == true) {
+        return false;
+    }
 
-Variant MsgPack::unpack_ext32(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint32(ifs);
-    return this->unpack_ext(ifs, size);
+    value = std::move(this->ready_.front());
+    this->ready_.pop_front();
+    return true;
 }
 
 
-Variant MsgPack::unpack_fixext1(std::istream& ifs) {
-    return this->unpack_ext(ifs, 1);
+void MsgPackDecoder::reset() {
+    this->ready_.clear();
+    std::vector<char>().swap(this->buffer_);
+    this->pos_ = 0;
+    this->remaining_ = 1;
+    this->good_ = true;
 }
 
 
-Variant MsgPack::unpack_fixext2(std::istream& ifs) {
-    return this->unpack_ext(ifs, 2);
-}
-
+bool MsgPackDecoder::emit(const char* pData, const std::size_t size) {
+    if (this->msgpack_.unpack(pData, size, this->pArena_) != true) {
+        this->good_ = false;
+        return false;
+    }
 
-Variant MsgPack::unpack_fixext4(std::istream& ifs) {
-    return this->unpack_ext(ifs, 4);
+    this->ready_.push_back(this->msgpack_.takeVariant());
+    return true;
 }
 
 
-Variant MsgPack::unpack_fixext8(std::istream& ifs) {
-    return this->unpack_ext(ifs, 8);
+// ========================================================================
+// MsgPackReader
+// ========================================================================
+MsgPackReader::MsgPackReader(VariantArena* pArena)
+    : msgpack_(), pArena_(pArena), p_(NULL), pEnd_(NULL),
+      ifs_(), decoder_(pArena), chunk_(), good_(true) {
 }
 
 
-Variant MsgPack::unpack_fixext16(std::istream& ifs) {
-    return this->unpack_ext(ifs, 16);
+bool MsgPackReader::open(const std::string& path) {
+    this->close();
+    this->ifs_.open(path.c_str(), std::ios::in | std::ios::binary);
+    if (!this->ifs_) {
+        this->good_ = false;
+        return false;
+    }
+    return true;
 }
 
 
-MsgPack::UINT8 MsgPack::unpack_uint8(std::istream& ifs) {
-    unsigned char value;
-    ifs.read((char*)&value, 1);
-    ++(this->debugCurrentPos_);
-
-    return value;
+void MsgPackReader::open(const char* pData, const std::size_t size) {
+    this->close();
+    this->p_ = pData;
+    this->pEnd_ = pData + size;
 }
 
 
-MsgPack::UINT16 MsgPack::unpack_uint16(std::istream& ifs) {
-    union {
-        char buf[2];
-        UINT16 value;
-    } u;
-    ifs.read(u.buf, 2);
-    this->debugCurrentPos_ += 2;
-
-    if (this->isLittleEndian() == true) {
-        this->changeEndian(&(u.buf[0]), 2);
+void MsgPackReader::close() {
+    if (this->ifs_.is_open() == true) {
+        this->ifs_.close();
     }
-
-    return u.value;
+    this->ifs_.clear();
+    this->decoder_.reset();
+    this->p_ = NULL;
+    this->pEnd_ = NULL;
+    this->good_ = true;
 }
 
 
-MsgPack::UINT32 MsgPack::unpack_uint32(std::istream& ifs) {
-    union {
-        char buf[4];
-        UINT32 value;
-    } u;
-    ifs.read(u.buf, 4);
-    this->debugCurrentPos_ += 4;
+bool MsgPackReader::next(Variant& value) {
+    if (this->p_ != NULL) {
+        if ((this->p_ == this->pEnd_) || (this->good_ != true)) {
+            return false;
+        }
 
-    if (this->isLittleEndian() == true) {
-        this->changeEndian(&(u.buf[0]), 4);
+        MsgPack::Cursor cur(this->p_, this->pEnd_, this->pArena_);
+        value = this->msgpack_.loadBinary(cur);
+        this->p_ = cur.p;
+        this->good_ = cur.good;
+        return this->good_;
     }
 
-    return u.value;
+    while (this->decoder_.next(value) != true) {
+        if ((this->good_ != true) || (this->fill() != true)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 
-MsgPack::UINT64 MsgPack::unpack_uint64(std::istream& ifs) {
-    union {
-        char buf[8];
-        UINT64 value;
-    } u;
-    ifs.read(u.buf, 8);
-    this->debugCurrentPos_ += 8;
+bool MsgPackReader::fill() {
+    if (this->ifs_.is_open() != true) {
+        return false;
+    }
 
-    if (this->isLittleEndian() == true) {
-        this->changeEndian(&(u.buf[0]), 8);
+    const std::size_t CHUNK_SIZE = 64 * 1024;
+    this->chunk_.resize(CHUNK_SIZE);
+    this->ifs_.read(&(this->chunk_[0]), CHUNK_SIZE);
+    const std::size_t size = static_cast<std::size_t>(this->ifs_.gcount());
+    if (size == 0) {
+        // a record cut off at the end of the file is an error
+        if ((this->ifs_.bad() == true) || (this->decoder_.pending() > 0)) {
+            this->good_ = false;
+        }
+        this->ifs_.close();
+        return false;
     }
 
-    return u.value;
+    // records decoded before an error are still returned
+    if (this->decoder_.feed(&(this->chunk_[0]), size) != true) {
+        this->good_ = false;
+    }
+    return true;
 }
 
 
-MsgPack::INT8 MsgPack::unpack_int8(std::istream& ifs) {
-    char value;
-    ifs.read((char*)&value, 1);
-    ++(this->debugCurrentPos_);
-
-    return value;
+// ========================================================================
+// MsgPackAppender
+// ========================================================================
+MsgPackAppender::MsgPackAppender() : msgpack_(), ofs_(), buffer_() {
 }
 
 
-MsgPack::INT16 MsgPack::unpack_int16(std::istream& ifs) {
-    union {
-        char buf[2];
-        INT16 value;
-    } u;
-    ifs.read(u.buf, 2);
-    this->debugCurrentPos_ += 2;
-
-    if (this->isLittleEndian() == true) {
-        this->changeEndian(&(u.buf[0]), 2);
-    }
-
-    return u.value;
+MsgPackAppender::~MsgPackAppender() {
+    this->close();
 }
 
 
-MsgPack::INT32 MsgPack::unpack_int32(std::istream& ifs) {
-    union {
-        char buf[4];
-        INT32 value;
-    } u;
-    ifs.read(u.buf, 4);
-    this->debugCurrentPos_ += 4;
-
-    if (this->isLittleEndian() == true) {
-        this->changeEndian(&(u.buf[0]), 4);
-    }
-
-    return u.value;
+bool MsgPackAppender::open(const std::string& path) {
+    this->close();
+    this->ofs_.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+    return this->ofs_.is_open();
 }
 
 
-MsgPack::INT64 MsgPack::unpack_int64(std::istream& ifs) {
-    union {
-        char buf[8];
-        INT64 value;
-    } u;
-    ifs.read(u.buf, 8);
-    this->debugCurrentPos_ += 8;
-
-    if (this->isLittleEndian() == true) {
-        this->changeEndian(&(u.buf[0]), 8);
+bool MsgPackAppender::close() {
+    if (this->ofs_.is_open() != true) {
+        return true;
     }
 
-    return u.value;
+    const bool ans = this->flush();
+    this->ofs_.close();
+    return ans;
 }
 
 
-float MsgPack::unpack_float(std::istream& ifs) {
-    assert(sizeof(float) == 4);
-    float value;
-    ifs.read((char*)&value, 4);
-    this->debugCurrentPos_ += 4;
+bool MsgPackAppender::append(const Variant& value) {
+    this->msgpack_.pack(value, this->buffer_);
 
-    if (this->isLittleEndian() == true) {
-        value = this->changeEndian<float>(value);
+    const std::size_t FLUSH_SIZE = 64 * 1024;
+    if (this->buffer_.size() >= FLUSH_SIZE) {
+        return this->flush();
     }
-
-    return value;
+    return true;
 }
 
-double MsgPack::unpack_double(std::istream& ifs)
-{
-    assert(sizeof(double) == 8);
-    double value;
-    ifs.read((char*)&value, 8);
-    this->debugCurrentPos_ += 8;
 
-    if (this->isLittleEndian() == true) {
-        value = this->changeEndian<double>(value);
+bool MsgPackAppender::flush() {
+    if (this->buffer_.empty() != true) {
+        this->ofs_.write(this->buffer_.data(), this->buffer_.size());
+        this->buffer_.clear();
     }
-
-    return value;
+    this->ofs_.flush();
+    return this->ofs_.good();
 }
 
 
-Variant MsgPack::unpack_fixraw(const char in, std::istream& ifs) {
-    const std::size_t size = (in & 31);
-
-    Variant ans;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
-
-        const std::string str(pBuf, size);
-        ans.set(str);
+// ========================================================================
+// MsgPackWriter
+// ========================================================================
+MsgPackWriter::MsgPackWriter() : msgpack_(), buffer_() {
+}
 
-        delete[] pBuf;
-        pBuf = NULL;
-    }
 
-    return ans;
+void MsgPackWriter::pack_nil() {
+    this->msgpack_.write(this->buffer_, char(0xc0));
 }
 
 
-Variant MsgPack::unpack_str8(std::istream& ifs) {
-    // NOT support UTF-8!
-    const std::size_t size = this->unpack_uint8(ifs);
-
-    Variant ans;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
+void MsgPackWriter::pack_bool(const bool value) {
+    this->msgpack_.pack(value, this->buffer_);
+}
 
-        const std::string str(pBuf, size);
-        ans.set(str);
 
-        delete[] pBuf;
-        pBuf = NULL;
+void MsgPackWriter::pack_int(const MsgPack::INT64 value) {
+    if (this->msgpack_.compact_ == true) {
+        this->msgpack_.pack_int(value, this->buffer_);
+    } else {
+        this->msgpack_.pack_int64(value, this->buffer_);
     }
-
-    return ans;
 }
 
 
-Variant MsgPack::unpack_str16(std::istream& ifs) {
-    // NOT support UTF-8!
-    const std::size_t size = this->unpack_uint16(ifs);
-
-    Variant ans;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
-
-        const std::string str(pBuf, size);
-        ans.set(str);
-
-        delete[] pBuf;
-        pBuf = NULL;
+void MsgPackWriter::pack_uint(const MsgPack::UINT64 value) {
+    if (this->msgpack_.compact_ == true) {
+        this->msgpack_.pack_uint(value, this->buffer_);
+    } else {
+        this->msgpack_.pack_uint64(value, this->buffer_);
     }
-
-    return ans;
 }
 
 
-Variant MsgPack::unpack_str32(std::istream& ifs) {
-    // NOT support UTF-8!
-    const std::size_t size = this->unpack_uint32(ifs);
-
-    Variant ans;
-    if (size != 0) {
-        char* pBuf = new char[size];
-        ifs.read(pBuf, size);
-        this->debugCurrentPos_ += size;
+void MsgPackWriter::pack_double(const double value) {
+    this->msgpack_.pack(value, this->buffer_);
+}
 
-        const std::string str(pBuf, size);
 
-        ans.set(str);
+void MsgPackWriter::pack_str(const char* pStr, const MsgPack::UINT32 size) {
+    this->msgpack_.pack_str(pStr, size, this->buffer_);
+}
 
-        delete[] pBuf;
-        pBuf = NULL;
-    }
 
-    return ans;
+void MsgPackWriter::pack_str(const std::string& str) {
+    this->msgpack_.pack(str, this->buffer_);
 }
 
 
-Variant MsgPack::unpack_fixarray(const char in, std::istream& ifs) {
-    const std::size_t size = (in & 15);
+void MsgPackWriter::pack_str(const char* pStr) {
+    this->msgpack_.pack_str(pStr, std::strlen(pStr), this->buffer_);
+}
 
-    Variant ans;
-    for (std::size_t i = 0; i < size; ++i) {
-        const Variant tmp = this->loadBinary(ifs);
-        ans.push_back(tmp);
-    }
 
-    return ans;
+void MsgPackWriter::pack_bin(const char* pData, const MsgPack::UINT32 size) {
+    this->msgpack_.pack_bin(pData, size, this->buffer_);
 }
 
 
-Variant MsgPack::unpack_array16(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint16(ifs);
+void MsgPackWriter::pack_ext(const MsgPack::INT8 type, const char* pData, const MsgPack::UINT32 size) {
+    this->msgpack_.pack_ext(type, pData, size, this->buffer_);
+}
 
-    Variant ans;
-    for (std::size_t i = 0; i < size; ++i) {
-        const Variant tmp = this->loadBinary(ifs);
-        ans.push_back(tmp);
-    }
 
-    return ans;
+void MsgPackWriter::pack_timestamp(const MsgPack::INT64 seconds, const MsgPack::UINT32 nanoseconds) {
+    this->msgpack_.pack_timestamp(seconds, nanoseconds, this->buffer_);
 }
 
 
-Variant MsgPack::unpack_array32(std::istream& ifs)
-{
-    const std::size_t size = this->unpack_uint32(ifs);
+void MsgPackWriter::pack_array_header(const MsgPack::UINT32 size) {
+    this->msgpack_.pack_array_header(size, this->buffer_);
+}
 
-    Variant ans;
-    for (std::size_t i = 0; i < size; ++i) {
-        const Variant tmp = this->loadBinary(ifs);
-        ans.push_back(tmp);
-    }
 
-    return ans;
+void MsgPackWriter::pack_map_header(const MsgPack::UINT32 size) {
+    this->msgpack_.pack_map_header(size, this->buffer_);
 }
 
 
-Variant MsgPack::unpack_fixmap(const char in, std::istream& ifs) {
-    const std::size_t size = (in & 15);
+void MsgPackWriter::pack(const Variant& value) {
+    this->msgpack_.pack(value, this->buffer_);
+}
 
-    Variant ans;
-    for (std::size_t i = 0; i < size; ++i) {
-        const Variant key = this->loadBinary(ifs);
-        const Variant value = this->loadBinary(ifs);
-        ans.add(key, value);
-    }
 
-    return ans;
+// ========================================================================
+// MsgPackIndex
+// ========================================================================
+MsgPackIndex::MsgPackIndex() : entries_(), dataSize_(0), depth_(0) {
 }
 
 
-Variant MsgPack::unpack_map16(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint16(ifs);
+bool MsgPackIndex::build(const char* pData, const std::size_t size, const std::size_t depth) {
+    this->clear();
 
-    Variant ans;
-    for (std::size_t i = 0; i < size; ++i) {
-        const Variant key = this->loadBinary(ifs);
-        const Variant value = this->loadBinary(ifs);
-        ans.add(key, value);
+    // validate once, so that the passes below can skip without checking
+    MsgPack::ScanInfo info;
+    if (MsgPack::scan(pData, size, info) != true) {
+        return false;
     }
 
-    return ans;
+    Entry root = Entry();
+    root.size = info.size;
+    this->entries_.push_back(root);
+    this->dataSize_ = size;
+    this->depth_ = depth;
+
+    // breadth first, so that the children of each container are contiguous
+    std::size_t begin = 0;
+    for (std::size_t level = 0; level < depth; ++level) {
+        const std::size_t end = this->entries_.size();
+        for (std::size_t i = begin; i < end; ++i) {
+            this->expand(pData, i);
+        }
+        if (this->entries_.size() == end) {
+            break;
+        }
+        begin = end;
+    }
+    return true;
 }
 
 
-Variant MsgPack::unpack_map32(std::istream& ifs) {
-    const std::size_t size = this->unpack_uint32(ifs);
+void MsgPackIndex::expand(const char* pData, const std::size_t i) {
+    const std::size_t offset = static_cast<std::size_t>(this->entries_[i].offset);
+    const std::size_t size = static_cast<std::size_t>(this->entries_[i].size);
+    const unsigned char c = static_cast<unsigned char>(pData[offset]);
+    const bool isMap = (((c >= 0x80) && (c <= 0x8f)) || (c == 0xde) || (c == 0xdf));
+    const bool isArray = (((c >= 0x90) && (c <= 0x9f)) || (c == 0xdc) || (c == 0xdd));
+    if ((isMap != true) && (isArray != true)) {
+        return;
+    }
+
+    UINT64 bodySize = 0;
+    UINT64 children = 0;
+    std::size_t pos = offset + MsgPack::scanHeader(pData + offset, size, bodySize, children);
+    const std::size_t end = offset + size;
+    const std::size_t first = this->entries_.size();
+    const UINT64 count = (isMap == true) ? (children / 2) : children;
+
+    for (UINT64 n = 0; n < count; ++n) {
+        Entry entry = Entry();
+        if (isMap == true) {
+            entry.key = pos;
+            const char* pKey = NULL;
+            std::size_t keySize = 0;
+            if (loadKey(pData, end, pos, pKey, keySize) == true) {
+                entry.hash = hashKey(pKey, keySize);
+            }
+            UINT64 remaining = 1;
+            MsgPack::scanObject(pData, end, pos, remaining);
+        }
 
-    Variant ans;
-    for (std::size_t i = 0; i < size; ++i) {
-        const Variant key = this->loadBinary(ifs);
-        const Variant value = this->loadBinary(ifs);
-        ans.add(key, value);
+        entry.offset = pos;
+        UINT64 remaining = 1;
+        MsgPack::scanObject(pData, end, pos, remaining);
+        entry.size = pos - entry.offset;
+        this->entries_.push_back(entry);
     }
 
-    return ans;
+    if (isMap == true) {
+        // keep the order of duplicate keys: the last one wins like in decoding
+        std::stable_sort(this->entries_.begin() + first, this->entries_.end());
+    }
+    this->entries_[i].first = first;
+    this->entries_[i].count = count;
 }
 
 
-void MsgPack::save(const std::string& path) const {
+bool MsgPackIndex::save(const std::string& path) const {
+    MsgPack writer;
+    std::string buf("MPIX", 4);
+    writer.write_be64(buf, this->dataSize_);
+    writer.write_be64(buf, this->depth_);
+    writer.write_be64(buf, this->entries_.size());
+    for (std::vector<Entry>::const_iterator p = this->entries_.begin(); p != this->entries_.end(); ++p) {
+        writer.write_be64(buf, p->offset);
+        writer.write_be64(buf, p->size);
+        writer.write_be64(buf, p->key);
+        writer.write_be64(buf, p->hash);
+        writer.write_be64(buf, p->first);
+        writer.write_be64(buf, p->count);
+    }
+
     std::ofstream ofs;
     ofs.open(path.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
-    ofs << this->packer();
+    ofs.write(buf.data(), buf.size());
     ofs.close();
+    return !ofs.fail();
 }
 
 
-std::string MsgPack::packer() const {
-    return this->pack(this->data_);
-}
-
-
-std::string MsgPack::pack(const Variant& data) const {
-    std::ostringstream os;
+bool MsgPackIndex::load(const std::string& path) {
+    this->clear();
 
-    switch (data.type()) {
-    case Variant::ARRAY:
-        os << this->pack_array(data);
-        break;
+    MsgPackMappedFile file;
+    if (file.open(path) != true) {
+        return false;
+    }
 
-    case Variant::MAP:
-        os << this->pack_map(data);
-        break;
+    const std::size_t HEADER_SIZE = 4 + 3 * 8;
+    const std::size_t ENTRY_SIZE = 6 * 8;
+    const char* p = file.data();
+    if ((file.size() < HEADER_SIZE) || (std::string(p, 4) != "MPIX")) {
+        return false;
+    }
 
-    default:
-        os << this->pack_scalar(data);
-        break;
+    const UINT64 count = MsgPack::load_be64(p + 20);
+    if ((file.size() - HEADER_SIZE) / ENTRY_SIZE != count) {
+        return false;
     }
 
-    return os.str();
+    this->dataSize_ = MsgPack::load_be64(p + 4);
+    this->depth_ = MsgPack::load_be64(p + 12);
+    this->entries_.resize(static_cast<std::size_t>(count));
+    p += HEADER_SIZE;
+    for (std::vector<Entry>::iterator q = this->entries_.begin(); q != this->entries_.end(); ++q) {
+        q->offset = MsgPack::load_be64(p);
+        q->size = MsgPack::load_be64(p + 8);
+        q->key = MsgPack::load_be64(p + 16);
+        q->hash = MsgPack::load_be64(p + 24);
+        q->first = MsgPack::load_be64(p + 32);
+        q->count = MsgPack::load_be64(p + 40);
+        p += ENTRY_SIZE;
+
+        // find reads the data and the entries at these positions without checking
+        const bool inData = ((q->size > 0) && (q->offset < this->dataSize_) &&
+                             (q->size <= this->dataSize_ - q->offset));
+        const bool inEntries = ((q->first <= count) && (q->count <= count - q->first));
+        if ((inData != true) || (inEntries != true)) {
+            this->clear();
+            return false;
+        }
+    }
+    if ((this->entries_.empty() == true) || (this->entries_[0].offset != 0)) {
+        this->clear();
+        return false;
+    }
+    return true;
 }
 
 
-std::string MsgPack::pack_scalar(const Variant& data) const {
-    std::ostringstream os;
-
-    switch (data.type()) {
-    case Variant::BOOLEAN:
-        os << this->pack(data.get_bool());
-        break;
-
-    case Variant::STRING:
-        {
-            const std::string str = data.get_str();
-            os << this->pack(str);
-        }
-        break;
+void MsgPackIndex::clear() {
+    this->entries_.clear();
+    this->dataSize_ = 0;
+    this->depth_ = 0;
+}
 
-    case Variant::INT:
-        {
-            int value = data.get_int();
-#if COMPILE_VALUE_SIZEOF_INT == 4
-            os << this->pack_int32(value);
-#else
-            os << this->pack_int64(value);
-#endif
-        }
-        break;
 
-    case Variant::LONG:
-        {
-            long value = data.get_long();
-#if COMPILE_VALUE_SIZEOF_LONG == 4
-            os << this->pack_int32(value);
-#else
-            os << this->pack_int64(value);
-#endif
-        }
-        break;
+bool MsgPackIndex::find(const char* pData, const std::size_t size, const std::string& path,
+                        std::size_t& offset, std::size_t& length) const {
+    if ((this->entries_.empty() == true) || (size != this->dataSize_)) {
+        return false;
+    }
 
-    case Variant::UINT:
-        {
-            unsigned int value = data.get_uint();
-#if COMPILE_VALUE_SIZEOF_INT == 4
-            os << this->pack_uint32(value);
-#else
-            os << this->pack_uint64(value);
-#endif
+    // node is the indexed entry of the current element, or npos below the index
+    const std::size_t npos = static_cast<std::size_t>(-1);
+    std::size_t node = 0;
+    offset = static_cast<std::size_t>(this->entries_[0].offset);
+    length = static_cast<std::size_t>(this->entries_[0].size);
+
+    std::size_t begin = 0;
+    while (begin <= path.size()) {
+        std::size_t end = path.find('/', begin);
+        if (end == std::string::npos) {
+            end = path.size();
         }
-        break;
-
-    case Variant::ULONG:
-        {
-            unsigned long value = data.get_ulong();
-#if COMPILE_VALUE_SIZEOF_LONG == 4
-            os << this->pack_uint32(value);
-#else
-            os << this->pack_uint64(value);
-#endif
+        const std::string name = path.substr(begin, end - begin);
+        begin = end + 1;
+        if (name.empty() == true) {
+            continue;
         }
-        break;
 
-    case Variant::DOUBLE:
-        {
-            double value = data.get_double();
-            os << this->pack(value);
+        if ((node == npos) || (this->entries_[node].count == 0)) {
+            node = npos;
+            if (findChild(pData, offset + length, name, offset, length) != true) {
+                return false;
+            }
+            continue;
         }
-        break;
 
-    case Variant::NONE:
-        {
-            std::ostringstream os_tmp;
-            this->write(os_tmp, char(0xc0));
-            os << os_tmp.str();
+        const Entry& parent = this->entries_[node];
+        const unsigned char c = static_cast<unsigned char>(pData[offset]);
+        const bool isMap = (((c >= 0x80) && (c <= 0x8f)) || (c == 0xde) || (c == 0xdf));
+        if (isMap == true) {
+            Entry probe = Entry();
+            probe.hash = hashKey(name.data(), name.size());
+            const std::vector<Entry>::const_iterator first = this->entries_.begin() + static_cast<std::size_t>(parent.first);
+            const std::vector<Entry>::const_iterator last = first + static_cast<std::size_t>(parent.count);
+            std::vector<Entry>::const_iterator p = std::upper_bound(first, last, probe);
+            node = npos;
+            while ((p != first) && ((p - 1)->hash == probe.hash)) {
+                --p;
+                const char* pKey = NULL;
+                std::size_t keySize = 0;
+                if ((loadKey(pData, size, static_cast<std::size_t>(p->key), pKey, keySize) == true) &&
+                    (keySize == name.size()) && (std::memcmp(pKey, name.data(), keySize) == 0)) {
+                    node = static_cast<std::size_t>(p - this->entries_.begin());
+                    break;
+                }
+            }
+            if (node == npos) {
+                return false;
+            }
+        } else {
+            UINT64 index = 0;
+            if ((parseIndex(name, index) != true) || (index >= parent.count)) {
+                return false;
+            }
+            node = static_cast<std::size_t>(parent.first + index);
         }
-        break;
-
-    default:
-        // something wrong.
-        abort();
-        break;
+        offset = static_cast<std::size_t>(this->entries_[node].offset);
+        length = static_cast<std::size_t>(this->entries_[node].size);
     }
-
-    return os.str();
+    return true;
 }
 
 
-std::string MsgPack::pack_array(const Variant& data) const {
-    assert(data.type() == Variant::ARRAY);
-    std::ostringstream os;
-
-    assert(sizeof(int) == 4);
-    const int size = data.size();
-    this->write(os, char(0xdd));
-    this->write(os, this->toBigEndian(size));
-
-    for (Variant::ArrayConstIterator p = data.beginArray(); p != data.endArray(); ++p) {
-        os << this->pack(*p);
+bool MsgPackIndex::get(const char* pData, const std::size_t size, const std::string& path,
+                       Variant& value, VariantArena* pArena) const {
+    std::size_t offset = 0;
+    std::size_t length = 0;
+    if (this->find(pData, size, path, offset, length) != true) {
+        return false;
     }
 
-    return os.str();
+    MsgPack msgpack;
+    if (msgpack.unpack(pData + offset, length, pArena) != true) {
+        return false;
+    }
+    value = msgpack.takeVariant();
+    return true;
 }
 
 
-std::string MsgPack::pack_map(const Variant& data) const {
-    assert(data.type() == Variant::MAP);
-    std::ostringstream os;
-
-    assert(sizeof(int) == 4);
-    const int size = data.size();
-    this->write(os, char(0xdf));
-    this->write(os, this->toBigEndian(size));
-
-    for (Variant::MapConstIterator p = data.beginMap(); p != data.endMap(); ++p) {
-        os << this->pack(p->first);
-        os << this->pack(p->second);
+bool MsgPackIndex::loadKey(const char* pData, const std::size_t size, const std::size_t offset,
+                           const char*& pKey, std::size_t& keySize) {
+    if (offset >= size) {
+        return false;
+    }
+    const unsigned char c = static_cast<unsigned char>(pData[offset]);
+    if (((c < 0xa0) || (c > 0xbf)) && ((c < 0xd9) || (c > 0xdb))) {
+        return false;
     }
 
-    return os.str();
+    UINT64 bodySize = 0;
+    UINT64 children = 0;
+    const std::size_t headerSize = MsgPack::scanHeader(pData + offset, size - offset, bodySize, children);
+    if ((size - offset < headerSize) || (size - offset - headerSize < bodySize)) {
+        return false;
+    }
+    pKey = pData + offset + headerSize;
+    keySize = static_cast<std::size_t>(bodySize);
+    return true;
 }
 
 
-std::string MsgPack::pack(const bool value) const {
-    std::ostringstream os;
-    if (value == true) {
-        this->write(os, char(0xc3));
-    } else {
-        this->write(os, char(0xc2));
+MsgPackIndex::UINT64 MsgPackIndex::hashKey(const char* pKey, const std::size_t keySize) {
+    UINT64 h = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < keySize; ++i) {
+        h = (h ^ static_cast<unsigned char>(pKey[i])) * 1099511628211ULL;
     }
-
-    return os.str();
+    return h;
 }
 
 
-std::string MsgPack::pack(const UINT8 value) const {
-    std::ostringstream os;
-
-    this->write(os, char(0xcc));
-    this->write(os, this->toBigEndian(value));
-
-    return os.str();
-}
-
+bool MsgPackIndex::findChild(const char* pData, const std::size_t size, const std::string& name,
+                             std::size_t& offset, std::size_t& length) {
+    const unsigned char c = static_cast<unsigned char>(pData[offset]);
+    const bool isMap = (((c >= 0x80) && (c <= 0x8f)) || (c == 0xde) || (c == 0xdf));
+    const bool isArray = (((c >= 0x90) && (c <= 0x9f)) || (c == 0xdc) || (c == 0xdd));
+    UINT64 index = 0;
+    if ((isMap != true) && ((isArray != true) || (parseIndex(name, index) != true))) {
+        return false;
+    }
 
-std::string MsgPack::pack(const UINT16 value) const {
-    std::ostringstream os;
+    UINT64 bodySize = 0;
+    UINT64 children = 0;
+    std::size_t pos = offset + MsgPack::scanHeader(pData + offset, size - offset, bodySize, children);
+    const UINT64 count = (isMap == true) ? (children / 2) : children;
+    if ((isArray == true) && (index >= count)) {
+        return false;
+    }
 
-    this->write(os, char(0xcd));
-    this->write(os, this->toBigEndian(value));
+    // the element was validated by build, so skipping cannot fail
+    bool found = false;
+    for (UINT64 n = 0; n < count; ++n) {
+        bool match = false;
+        if (isMap == true) {
+            const char* pKey = NULL;
+            std::size_t keySize = 0;
+            match = ((loadKey(pData, size, pos, pKey, keySize) == true) &&
+                     (keySize == name.size()) && (std::memcmp(pKey, name.data(), keySize) == 0));
+            UINT64 remaining = 1;
+            MsgPack::scanObject(pData, size, pos, remaining);
+        } else {
+            match = (n == index);
+        }
 
-    return os.str();
+        const std::size_t begin = pos;
+        UINT64 remaining = 1;
+        MsgPack::scanObject(pData, size, pos, remaining);
+        if (match == true) {
+            // later duplicate keys win like in decoding
+            found = true;
+            offset = begin;
+            length = pos - begin;
+            if (isArray == true) {
+                break;
+            }
+        }
+    }
+    return found;
 }
 
 
-std::string MsgPack::pack_uint32(const UINT32 value) const {
-    std::ostringstream os;
-
-    this->write(os, char(0xce));
-    this->write(os, this->toBigEndian(value));
-
-    return os.str();
+bool MsgPackIndex::parseIndex(const std::string& name, UINT64& index) {
+    if ((name.empty() == true) || (name.size() > 19)) {
+        return false;
+    }
+    index = 0;
+    for (std::string::const_iterator p = name.begin(); p != name.end(); ++p) {
+        if ((*p < '0') || (*p > '9')) {
+            return false;
+        }
+        index = index * 10 + static_cast<UINT64>(*p - '0');
+    }
+    return true;
 }
 
 
-std::string MsgPack::pack_uint64(const UINT64 value) const {
-    std::ostringstream os;
-
-    this->write(os, char(0xcf));
-    this->write(os, this->toBigEndian(value));
-
-    return os.str();
+// ========================================================================
+// MsgPackMappedFile
+// ========================================================================
+MsgPackMappedFile::MsgPackMappedFile() : pData_(NULL), size_(0), mapped_(false) {
 }
 
 
-std::string MsgPack::pack(const INT8 value) const {
-    std::ostringstream os;
-
-    this->write(os, char(0xd0));
-    this->write(os, this->toBigEndian(value));
-
-    return os.str();
+MsgPackMappedFile::~MsgPackMappedFile() {
+    this->close();
 }
 
 
-std::string MsgPack::pack(const INT16 value) const {
-    std::ostringstream os;
+bool MsgPackMappedFile::open(const std::string& path) {
+    this->close();
 
-    this->write(os, char(0xd1));
-    this->write(os, this->toBigEndian(value));
-
-    return os.str();
-}
-
-
-std::string MsgPack::pack_int32(const INT32 value) const {
-    std::ostringstream os;
+#if MSGPACK_ALT_USE_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
 
-    this->write(os, char(0xd2));
-    this->write(os, this->toBigEndian(value));
+    struct stat st;
+    if ((::fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        const std::size_t size = static_cast<std::size_t>(st.st_size);
+        void* p = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            // decoding reads the file once from the front
+            ::madvise(p, size, MADV_SEQUENTIAL);
+            ::close(fd);
+
+            this->pData_ = static_cast<const char*>(p);
+            this->size_ = size;
+            this->mapped_ = true;
+            return true;
+        }
+    }
 
-    return os.str();
+    // pipes, devices and empty files
+    const bool ans = this->readAll(fd);
+    ::close(fd);
+    return ans;
+#else
+    std::ifstream ifs;
+    ifs.open(path.c_str(), std::ios::in | std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+    return this->readAll(ifs);
+#endif // MSGPACK_ALT_USE_MMAP
 }
 
 
-std::string MsgPack::pack_int64(const INT64 value) const {
-    std::ostringstream os;
-
-    this->write(os, char(0xd3));
-    this->write(os, this->toBigEndian(value));
+void MsgPackMappedFile::close() {
+#if MSGPACK_ALT_USE_MMAP
+    if (this->mapped_ == true) {
+        ::munmap(const_cast<char*>(this->pData_), this->size_);
+    }
+#endif // MSGPACK_ALT_USE_MMAP
 
-    return os.str();
+    std::vector<char>().swap(this->buffer_);
+    this->pData_ = NULL;
+    this->size_ = 0;
+    this->mapped_ = false;
 }
 
 
-std::string MsgPack::pack(const double value) const {
-    assert(sizeof(double) == 8);
-    std::ostringstream os;
-
-    this->write(os, char(0xcb));
-    this->write(os, this->toBigEndian(value));
+#if MSGPACK_ALT_USE_MMAP
+bool MsgPackMappedFile::readAll(const int fd) {
+    // the size is unknown in advance for pipes
+    const std::size_t CHUNK_SIZE = 64 * 1024;
+    std::size_t size = 0;
+    for (;;) {
+        this->buffer_.resize(size + CHUNK_SIZE);
+        const ssize_t n = ::read(fd, &(this->buffer_[size]), CHUNK_SIZE);
+        if (n > 0) {
+            size += static_cast<std::size_t>(n);
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    this->buffer_.resize(size);
 
-    return os.str();
+    this->pData_ = (size > 0) ? &(this->buffer_[0]) : NULL;
+    this->size_ = size;
+    return true;
 }
+#else
+bool MsgPackMappedFile::readAll(std::istream& in) {
+    const std::size_t CHUNK_SIZE = 64 * 1024;
+    std::size_t size = 0;
+    while (in) {
+        this->buffer_.resize(size + CHUNK_SIZE);
+        in.read(&(this->buffer_[size]), CHUNK_SIZE);
+        size += static_cast<std::size_t>(in.gcount());
+    }
+    if (in.bad() == true) {
+        return false;
+    }
+    this->buffer_.resize(size);
 
-
-std::string MsgPack::pack(const std::string& str) const {
-    std::ostringstream os;
-    const UINT32 N = str.length();
-
-    this->write(os, char(0xdb));
-    this->write(os, this->toBigEndian(N));
-    os.write(str.c_str(), sizeof(char) * N);
-
-    return os.str();
+    this->pData_ = (size > 0) ? &(this->buffer_[0]) : NULL;
+    this->size_ = size;
+    return true;
 }
-
+#endif // MSGPACK_ALT_USE_MMAP
 
 #endif // MSGPACK_ALT_H
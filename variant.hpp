@@ -1,13 +1,23 @@
 #ifndef VARIANT_H
 #define VARIANT_H
 
+#include <cstdio>
 #include <cstdlib>
 #include <vector>
 #include <map>
+#include <string>
+#include <functional>
 #include <sstream>
 #include <limits>
 #include <cmath>
 #include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <cstddef>
 
 
 template <typename IteratorType, typename ValueType>
@@ -26,15 +36,16 @@ public:
         if (&rhs != this) {
             this->it_ = rhs.it_;
         }
+        return *this;
     }
 
 public:
     ValueType& operator*() {
-        return **(this->it_);
+        return *(this->it_);
     }
 
     ValueType* operator->() {
-        return *(this->it_);
+        return &(*(this->it_));
     }
 
     VariantVectorIterator& operator++() {
@@ -42,9 +53,10 @@ public:
         return *this;
     }
 
-    VariantVectorIterator& operator++(int n) {
-        this->it_++(n);
-        return *this;
+    VariantVectorIterator operator++(int) {
+        VariantVectorIterator tmp(*this);
+        ++(this->it_);
+        return tmp;
     }
 
     VariantVectorIterator& operator--() {
@@ -52,9 +64,10 @@ public:
         return *this;
     }
 
-    VariantVectorIterator& operator--(int n) {
-        this->it_--(n);
-        return *this;
+    VariantVectorIterator operator--(int) {
+        VariantVectorIterator tmp(*this);
+        --(this->it_);
+        return tmp;
     }
 
     bool operator==(const VariantVectorIterator& rhs) const {
@@ -86,15 +99,16 @@ public:
         if (&rhs != this) {
             this->it_ = rhs.it_;
         }
+        return *this;
     }
 
 public:
     ValueType& operator*() const {
-        return **(this->it_);
+        return *(this->it_);
     }
 
     ValueType* operator->() const {
-        return *(this->it_);
+        return &(*(this->it_));
     }
 
     VariantVectorConstIterator& operator++() {
@@ -102,9 +116,10 @@ public:
         return *this;
     }
 
-    VariantVectorConstIterator& operator++(int n) {
-        this->it_++(n);
-        return *this;
+    VariantVectorConstIterator operator++(int) {
+        VariantVectorConstIterator tmp(*this);
+        ++(this->it_);
+        return tmp;
     }
 
     VariantVectorConstIterator& operator--() {
@@ -112,9 +127,10 @@ public:
         return *this;
     }
 
-    VariantVectorConstIterator& operator--(int n) {
-        this->it_--(n);
-        return *this;
+    VariantVectorConstIterator operator--(int) {
+        VariantVectorConstIterator tmp(*this);
+        --(this->it_);
+        return tmp;
     }
 
     bool operator==(const VariantVectorConstIterator& rhs) const {
@@ -130,16 +146,36 @@ private:
 };
 
 
+/// 連想配列の要素のキーと値への参照
+///
+/// 反復子の operator-> から返すため、自身を指す operator-> を持つ。
+template <typename KeyType, typename ValueType>
+struct VariantMapPair {
+    VariantMapPair(KeyType& key, ValueType& value) : first(key), second(value) {
+    }
+
+    VariantMapPair* operator->() {
+        return this;
+    }
+
+    KeyType& first;
+    ValueType& second;
+};
+
+
+/// キー・値を複製せずに参照で返す反復子 (キーは変更できない)
 template <typename IteratorType, typename KeyType, typename ValueType>
 class VariantMapIterator {
 public:
-    typedef std::pair<KeyType, ValueType> PairType;
+    typedef VariantMapPair<const KeyType, ValueType> PairType;
 
 public:
-    VariantMapIterator(const IteratorType& it) : it_(it) {
+    /// end までの削除済みの要素は読み飛ばす
+    VariantMapIterator(const IteratorType& it, const IteratorType& end) : it_(it), end_(end) {
+        this->skip();
     }
 
-    VariantMapIterator(const VariantMapIterator& rhs) : it_(rhs.it_) {
+    VariantMapIterator(const VariantMapIterator& rhs) : it_(rhs.it_), end_(rhs.end_) {
     }
 
     ~VariantMapIterator() {
@@ -148,41 +184,43 @@ public:
     VariantMapIterator& operator=(const VariantMapIterator& rhs) {
         if (&rhs != this) {
             this->it_ = rhs.it_;
+            this->end_ = rhs.end_;
         }
         return *this;
     }
 
 public:
-    PairType& operator*() {
-        this->pair_.first = *(this->it_->first);
-        this->pair_.second = *(this->it_->second);
-        return this->pair_;
+    PairType operator*() const {
+        return PairType(*(this->it_->first), *(this->it_->second));
     }
 
-    PairType* operator->() {
-        this->pair_.first = *(this->it_->first);
-        this->pair_.second = *(this->it_->second);
-        return &(this->pair_);
+    PairType operator->() const {
+        return PairType(*(this->it_->first), *(this->it_->second));
     }
 
     VariantMapIterator& operator++() {
         ++(this->it_);
+        this->skip();
         return *this;
     }
 
-    VariantMapIterator& operator++(int n) {
-        this->it_++(n);
-        return *this;
+    VariantMapIterator operator++(int) {
+        VariantMapIterator tmp(*this);
+        ++(*this);
+        return tmp;
     }
 
     VariantMapIterator& operator--() {
-        --(this->it_);
+        do {
+            --(this->it_);
+        } while (this->it_->first == NULL);
         return *this;
     }
 
-    VariantMapIterator& operator--(int n) {
-        this->it_--(n);
-        return *this;
+    VariantMapIterator operator--(int) {
+        VariantMapIterator tmp(*this);
+        --(*this);
+        return tmp;
     }
 
     bool operator==(const VariantMapIterator& rhs) const {
@@ -193,22 +231,31 @@ public:
         return (this->it_ != rhs.it_);
     }
 
+private:
+    void skip() {
+        while ((this->it_ != this->end_) && (this->it_->first == NULL)) {
+            ++(this->it_);
+        }
+    }
+
 private:
     IteratorType it_;
-    PairType pair_;
+    IteratorType end_;
 };
 
 
 template <typename IteratorType, typename KeyType, typename ValueType>
 class VariantMapConstIterator {
 public:
-    typedef std::pair<KeyType, ValueType> PairType;
+    typedef VariantMapPair<const KeyType, const ValueType> PairType;
 
 public:
-    VariantMapConstIterator(const IteratorType& it) : it_(it) {
+    /// end までの削除済みの要素は読み飛ばす
+    VariantMapConstIterator(const IteratorType& it, const IteratorType& end) : it_(it), end_(end) {
+        this->skip();
     }
 
-    VariantMapConstIterator(const VariantMapConstIterator& rhs) : it_(rhs.it_) {
+    VariantMapConstIterator(const VariantMapConstIterator& rhs) : it_(rhs.it_), end_(rhs.end_) {
     }
 
     ~VariantMapConstIterator() {
@@ -217,40 +264,43 @@ public:
     VariantMapConstIterator& operator=(const VariantMapConstIterator& rhs) {
         if (&rhs != this) {
             this->it_ = rhs.it_;
+            this->end_ = rhs.end_;
         }
+        return *this;
     }
 
 public:
-    const PairType& operator*() const {
-        this->pair_.first = *(this->it_->first);
-        this->pair_.second = *(this->it_->second);
-        return this->pair_;
+    PairType operator*() const {
+        return PairType(*(this->it_->first), *(this->it_->second));
     }
 
-    const PairType* operator->() const {
-        this->pair_.first = *(this->it_->first);
-        this->pair_.second = *(this->it_->second);
-        return &(this->pair_);
+    PairType operator->() const {
+        return PairType(*(this->it_->first), *(this->it_->second));
     }
 
     VariantMapConstIterator& operator++() {
         ++(this->it_);
+        this->skip();
         return *this;
     }
 
-    VariantMapConstIterator& operator++(int n) {
-        this->it_++(n);
-        return *this;
+    VariantMapConstIterator operator++(int) {
+        VariantMapConstIterator tmp(*this);
+        ++(*this);
+        return tmp;
     }
 
     VariantMapConstIterator& operator--() {
-        --(this->it_);
+        do {
+            --(this->it_);
+        } while (this->it_->first == NULL);
         return *this;
     }
 
-    VariantMapConstIterator& operator--(int n) {
-        this->it_--(n);
-        return *this;
+    VariantMapConstIterator operator--(int) {
+        VariantMapConstIterator tmp(*this);
+        --(*this);
+        return tmp;
     }
 
     bool operator==(const VariantMapConstIterator& rhs) const {
@@ -261,22 +311,255 @@ public:
         return (this->it_ != rhs.it_);
     }
 
+private:
+    void skip() {
+        while ((this->it_ != this->end_) && (this->it_->first == NULL)) {
+            ++(this->it_);
+        }
+    }
+
 private:
     IteratorType it_;
-    mutable PairType pair_;
+    IteratorType end_;
+};
+
+
+class Variant;
+
+/// Variant の木をまとめて確保・解放するためのメモリ領域
+///
+/// 確保はポインタを進めるだけで行い、個々の解放は行わない。
+/// 確保したメモリは release() もしくはデストラクタでまとめて解放する。
+/// この arena を使う Variant より先に破棄してはならない。
+class VariantArena {
+public:
+    explicit VariantArena(std::size_t blockSize = 64 * 1024);
+
+    /// 呼び出し側が用意したバッファを最初のブロックとして使う
+    VariantArena(void* pBuffer, std::size_t size, std::size_t blockSize = 64 * 1024);
+    ~VariantArena();
+
+private:
+    VariantArena(const VariantArena& rhs);
+    VariantArena& operator=(const VariantArena& rhs);
+
+public:
+    void* allocate(std::size_t size, std::size_t alignment);
+
+    /// 確保したメモリをすべて解放する
+    void release();
+
+protected:
+    struct Block {
+        Block* pNext;
+    };
+
+    void* pInitial_;
+    std::size_t initialSize_;
+    std::size_t nextBlockSize_;
+    const std::size_t blockSize_;
+    char* pCurrent_;
+    char* pEnd_;
+    Block* pBlocks_;
+};
+
+
+/// Variant 用の標準アロケータ
+///
+/// arena が NULL の場合は通常のヒープを使う。
+template <typename T>
+class VariantAllocator;
+
+/// VariantAllocator::construct の実体
+///
+/// Variant 自身は構築先のアロケータ (arena) に束縛する。
+template <typename T>
+struct VariantConstructor {
+    template <typename... Args>
+    static void construct(T* p, VariantArena*, Args&&... args) {
+        ::new(static_cast<void*>(p)) T(std::forward<Args>(args)...);
+    }
+};
+
+template <>
+struct VariantConstructor<Variant> {
+    static void construct(Variant* p, VariantArena* pArena, const Variant& rhs);
+    static void construct(Variant* p, VariantArena* pArena, Variant& rhs);
+    static void construct(Variant* p, VariantArena* pArena, Variant&& rhs);
+
+    template <typename... Args>
+    static void construct(Variant* p, VariantArena* pArena, Args&&... args);
+};
+
+template <typename T>
+class VariantAllocator {
+public:
+    typedef T value_type;
+
+public:
+    VariantAllocator(VariantArena* pArena = NULL) : pArena_(pArena) {
+    }
+
+    template <typename U>
+    VariantAllocator(const VariantAllocator<U>& rhs) : pArena_(rhs.arena()) {
+    }
+
+public:
+    T* allocate(const std::size_t n) {
+        if (this->pArena_ != NULL) {
+            return static_cast<T*>(this->pArena_->allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t) {
+        if (this->pArena_ == NULL) {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        VariantConstructor<U>::construct(p, this->pArena_, std::forward<Args>(args)...);
+    }
+
+    VariantArena* arena() const {
+        return this->pArena_;
+    }
+
+    template <typename U>
+    bool operator==(const VariantAllocator<U>& rhs) const {
+        return (this->pArena_ == rhs.arena());
+    }
+
+    template <typename U>
+    bool operator!=(const VariantAllocator<U>& rhs) const {
+        return (this->pArena_ != rhs.arena());
+    }
+
+private:
+    VariantArena* pArena_;
+};
+
+
+/// 連想配列の要素
+///
+/// first が NULL の要素は削除済み。
+struct VariantMapEntry {
+    Variant* first;
+    Variant* second;
+    std::size_t hash;
+};
+
+/// 挿入順を保持する連想配列
+///
+/// 要素は挿入順に entries_ に並べ、index_ (オープンアドレス法のハッシュ表)
+/// からその位置を引く。削除した要素は印を付けて残し、増えたところで詰める。
+/// キーと値は個別に確保するので、要素を追加・削除しても他の要素の
+/// キー・値への参照は無効にならない。
+class VariantMap {
+public:
+    typedef VariantMapEntry Entry;
+
+public:
+    explicit VariantMap(VariantArena* pArena = NULL);
+    ~VariantMap();
+
+private:
+    VariantMap(const VariantMap& rhs);
+    VariantMap& operator=(const VariantMap& rhs);
+
+public:
+    std::size_t size() const {
+        return this->size_;
+    }
+
+    /// 削除済みの要素も含む範囲の先頭
+    Entry* begin() {
+        return this->entries_.data();
+    }
+
+    Entry* end() {
+        return this->entries_.data() + this->entries_.size();
+    }
+
+    const Entry* begin() const {
+        return this->entries_.data();
+    }
+
+    const Entry* end() const {
+        return this->entries_.data() + this->entries_.size();
+    }
+
+    /// key の要素を返す (なければ NULL)
+    Entry* find(const Variant& key);
+    const Entry* find(const Variant& key) const;
+
+    /// key の要素を返す。なければ値を NONE として末尾に追加する
+    ///
+    /// 返した要素へのポインタは次の追加・削除まで有効
+    Entry* insert(const Variant& key);
+    Entry* insert(Variant&& key);
+
+    void erase(Entry* pEntry);
+    void reserve(std::size_t size);
+
+    /// 要素をキーの昇順 (Variant::operator<) に並べ替える
+    void sort();
+
+protected:
+    /// index_ の空き・削除済みを表す値
+    enum {
+        EMPTY = 0,
+        DELETED = 0xffffffff
+    };
+
+    /// key の入っている index_ の位置を返す (なければ入れるべき位置)
+    std::size_t lookup(const Variant& key, std::size_t hash, bool& found) const;
+
+    template <typename Key>
+    Entry* insertNode(Key&& key);
+
+    /// 削除済みの要素を詰め、index_ を capacity 以上の大きさで作り直す
+    void rehash(std::size_t capacity);
+
+    template <typename... Args>
+    Variant* newNode(Args&&... args);
+    void deleteNode(Variant* p);
+
+protected:
+    typedef std::vector<Entry, VariantAllocator<Entry> > EntryContainerType;
+    typedef std::vector<std::uint32_t, VariantAllocator<std::uint32_t> > IndexContainerType;
+
+    EntryContainerType entries_;
+    IndexContainerType index_;   // EMPTY, DELETED or (position in entries_ + 1)
+    std::size_t size_;           // number of live entries
+    VariantArena* pArena_;
 };
 
 
+/// 任意の型の値を保持する
+///
+/// arena を指定して構築したオブジェクトとその子は、すべて arena から
+/// メモリを確保し、デストラクタでは何も解放しない (arena ごと解放する)。
+/// arena はオブジェクトの構築時に決まり、代入では変わらない。
+/// 異なる arena (またはヒープ) のオブジェクトを代入すると複製される。
 class Variant {
 protected:
-    typedef std::vector<Variant*> ArrayContainerType;
-    typedef std::map<Variant*, Variant*> MapContainerType;
+    typedef std::vector<Variant, VariantAllocator<Variant> > ArrayContainerType;
+    typedef VariantMap MapContainerType;
 
 public:
-    typedef VariantVectorIterator<ArrayContainerType::iterator, Variant> ArrayIterator;
-    typedef VariantVectorConstIterator<ArrayContainerType::const_iterator, Variant> ArrayConstIterator;
-    typedef VariantMapIterator<MapContainerType::iterator, Variant, Variant> MapIterator;
-    typedef VariantMapConstIterator<MapContainerType::const_iterator, Variant, Variant> MapConstIterator;
+    /// ARRAY の要素は連続したメモリに値として格納される。
+    /// std::vector と同様に、要素数を増やす操作 (push_back, emplace_back,
+    /// resize, 範囲外への setAt/getAt) で反復子・要素への参照は無効になる。
+    typedef VariantVectorIterator<Variant*, Variant> ArrayIterator;
+    typedef VariantVectorConstIterator<const Variant*, const Variant> ArrayConstIterator;
+
+    /// MAP は挿入順に反復する (sort_keys() の後はキーの昇順)。
+    /// erase で反復子は無効になるが、キー・値への参照は要素が残る限り有効。
+    typedef VariantMapIterator<VariantMapEntry*, Variant, Variant> MapIterator;
+    typedef VariantMapConstIterator<const VariantMapEntry*, Variant, Variant> MapConstIterator;
 
     enum DataType {
         BOOLEAN,
@@ -288,11 +571,15 @@ public:
         DOUBLE,
         ARRAY,
         MAP,
-        NONE
+        NONE,
+        BINARY,     // bytes other than text
+        EXT,        // bytes with an application-defined type (ext_type)
+        TIMESTAMP   // seconds since the UNIX epoch and nanoseconds
     };
 
 public:
     explicit Variant(DataType dataType = NONE);
+    explicit Variant(VariantArena* pArena, DataType dataType = NONE);
     Variant(bool value);
     Variant(char value);
     Variant(unsigned char value);
@@ -305,24 +592,42 @@ public:
     Variant(const char* pStr, const std::size_t size);
     Variant(const std::string& str);
     Variant(const Variant& rhs);
-    virtual ~Variant();
+    Variant(const Variant& rhs, VariantArena* pArena);
+    Variant(Variant&& rhs) noexcept;
+    ~Variant();
 
     Variant& operator=(const Variant& rhs);
+    Variant& operator=(Variant&& rhs) noexcept;
+
+    /// 内容を交換する
+    ///
+    /// arena が異なる場合はそれぞれの arena に複製される
+    void swap(Variant& rhs);
+
+    /// NONE にして、以後 pArena からメモリを確保するようにする
+    ///
+    /// コンテナの要素に対して使ってはならない
+    void reset(VariantArena* pArena = NULL);
+
+    /// メモリの確保先 (ヒープの場合は NULL)
+    VariantArena* arena() const {
+        return this->pArena_;
+    }
 
 public:
     // ====================================================================
     // properties
     // ====================================================================
     DataType type() const {
-        return this->type_;
+        return static_cast<DataType>(this->type_);
     };
 
     std::size_t size() const {
         std::size_t ans = 1;
         if (this->type_ == ARRAY) {
-            ans = this->array_.size();
+            ans = this->array().size();
         } else if (this->type_ == MAP) {
-            ans = this->map_.size();
+            ans = this->map().size();
         }
         return ans;
     };
@@ -332,10 +637,21 @@ public:
     // vector(array) container operation
     // ====================================================================
     void resize(std::size_t size);
+    void reserve(std::size_t size);
     void push_back(const Variant& value);
+    void push_back(Variant&& value);
     const Variant& getAt(std::size_t index) const;
     Variant& getAt(std::size_t index);
     void setAt(std::size_t index, const Variant& value);
+    void setAt(std::size_t index, Variant&& value);
+
+    /// 末尾に args から直接構築した要素を追加し、その参照を返す
+    template <typename... Args>
+    Variant& emplace_back(Args&&... args) {
+        this->makeArray();
+        this->array().emplace_back(std::forward<Args>(args)...);
+        return this->array().back();
+    }
 
     ArrayIterator beginArray();
     ArrayIterator endArray();
@@ -346,7 +662,9 @@ public:
     // map(dict) container operation
     // ====================================================================
     void add(const Variant& key, const Variant& value);
+    void add(Variant&& key, Variant&& value);
     Variant& operator[](const Variant& key);
+    Variant& operator[](Variant&& key);
     const Variant& operator[](const Variant& key) const;
     bool has_key(const Variant& key) const;
     void erase(const Variant& key);
@@ -356,6 +674,9 @@ public:
     MapConstIterator beginMap() const;
     MapConstIterator endMap() const;
 
+    /// この MAP と、その下にあるすべての MAP の要素をキーの昇順に並べ替える
+    void sort_keys();
+
     // ====================================================================
     // scalar operation
     // ====================================================================
@@ -379,25 +700,137 @@ public:
     double get_double() const;
     std::string get_str() const;
 
+    /// STRING, BINARY, EXT の内容の先頭を返す (NUL 終端されていない)
+    const char* str_data() const;
+
+    /// STRING, BINARY, EXT の内容のバイト数を返す
+    std::size_t str_size() const;
+
+    /// バイト列 (BINARY) にする
+    ///
+    /// @param[in] pData 内容の先頭
+    /// @param[in] size  内容のバイト数
+    /// @param[in] view  true の場合はコピーせずに参照する (set_view と同じ)
+    void set_binary(const char* pData, const std::size_t size, const bool view = false);
+
+    /// 型の番号を持つバイト列 (EXT) にする
+    ///
+    /// @param[in] extType 型の番号 (負の値は MsgPack の仕様で予約されている)
+    /// @param[in] pData   内容の先頭
+    /// @param[in] size    内容のバイト数
+    /// @param[in] view    true の場合はコピーせずに参照する (set_view と同じ)
+    void set_ext(const signed char extType, const char* pData, const std::size_t size, const bool view = false);
+
+    /// 時刻 (TIMESTAMP) にする
+    ///
+    /// 整数の get_* は秒数を返し、get_double は秒未満の部分を含めて返す。
+    /// @param[in] seconds     UNIX エポックからの秒数 (負の場合はエポックより前)
+    /// @param[in] nanoseconds 秒未満の部分 (0 から 999999999)
+    void set_timestamp(const std::int64_t seconds, const std::uint32_t nanoseconds = 0);
+
+    /// TIMESTAMP の秒数を返す (TIMESTAMP 以外は 0)
+    std::int64_t timestamp_sec() const {
+        return (this->type_ == TIMESTAMP) ? this->scalar_.sec_ : 0;
+    }
+
+    /// TIMESTAMP の秒未満の部分をナノ秒で返す (TIMESTAMP 以外は 0)
+    std::uint32_t timestamp_nsec() const {
+        return (this->type_ == TIMESTAMP) ? this->size_ : 0;
+    }
+
+    /// EXT の型の番号を返す (EXT 以外は 0)
+    signed char ext_type() const {
+        return (this->type_ == EXT) ? this->extType_ : 0;
+    }
+
+    /// 内容をコピーせずに pStr を参照する STRING にする
+    ///
+    /// pStr の指すメモリはこのオブジェクト (と、ムーブした先) を使い終わるまで
+    /// 保持しておくこと。コピーした先は内容をコピーして持つ。
+    /// INLINE_STR_SIZE 以下の文字列はコピーして持つ。
+    void set_view(const char* pStr, const std::size_t size);
+
+    /// 外部のメモリを参照している STRING, BINARY, EXT かどうか
+    bool is_view() const {
+        return ((this->isBytes() == true) && (this->view_ == true));
+    }
+
+    /// 外部のメモリを参照している文字列をコピーして持つようにする
+    ///
+    /// ARRAY と MAP は要素 (MAP のキーを含む) をすべてコピーして持つようにする。
+    void detach();
+
     bool operator==(const Variant& rhs) const;
     bool operator!=(const Variant& rhs) const {
         return !(this->operator==(rhs));
     }
 
+    /// 型 (DataType の順)、値の順に比較する全順序
+    ///
+    /// 数値は同じ型同士でのみ値で比較し、文字列はバイト列として比較する。
+    /// MAP は operator== と同じく挿入順によらず、キーの順に並べて比較する
+    bool operator<(const Variant& rhs) const {
+        return (this->compare(rhs) < 0);
+    }
+
+    /// 内容から計算したハッシュ値を返す
+    ///
+    /// operator== で等しいオブジェクトは同じ値を返す
+    std::size_t hash() const;
+
     void merge(const Variant& rhs);
+    void merge(Variant&& rhs);
 
     /// 内容をデバッグ用の文字列として返す
     std::string str() const;
 
 protected:
-    void clearChildren();
-    void copyChildren(const Variant& rhs);
+    /// 保持している文字列やコンテナを解放して NONE にする
+    void release();
+
+    /// rhs の内容を複製する (this は NONE であること)
+    void copyFrom(const Variant& rhs);
+
+    void makeArray();
+    void makeMap();
+    void setString(const char* pStr, std::size_t size, DataType type = STRING, signed char extType = 0);
+
+    /// 内容をコピーせずに参照する (INLINE_STR_SIZE 以下はコピーする)
+    void setView(const char* pStr, std::size_t size, DataType type, signed char extType);
+
+    /// 内容をバイト列として持つ型 (STRING, BINARY, EXT) かどうか
+    bool isBytes() const {
+        return ((this->type_ == STRING) || (this->type_ == BINARY) || (this->type_ == EXT));
+    }
+
+    /// arena が同じもの同士で内容を交換する
+    void rawSwap(Variant& rhs) noexcept;
 
-    MapContainerType::iterator find(const Variant& rhs);
-    MapContainerType::const_iterator find(const Variant& rhs) const;
+    /// operator< の実体 (負・0・正を返す)
+    int compare(const Variant& rhs) const;
+
+    ArrayContainerType& array() {
+        return *(this->scalar_.pArray_);
+    }
+
+    const ArrayContainerType& array() const {
+        return *(this->scalar_.pArray_);
+    }
+
+    MapContainerType& map() {
+        return *(this->scalar_.pMap_);
+    }
+
+    const MapContainerType& map() const {
+        return *(this->scalar_.pMap_);
+    }
 
     static const Variant& getNullObject();
 
+    static void hashCombine(std::size_t& seed, const std::size_t value) {
+        seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+
 protected:
     template <typename T>
     std::string x2s(const T& t) const {
@@ -445,15 +878,25 @@ protected:
         int int_;
         unsigned int uint_;
         long long_;
-        unsigned ulong_;
+        unsigned long ulong_;
         double double_;
+        std::int64_t sec_;             // TIMESTAMP (nanoseconds are in size_)
+        char* pStr_;                   // STRING/BINARY/EXT longer than INLINE_STR_SIZE
+        char inline_[sizeof(double)];  // STRING/BINARY/EXT up to INLINE_STR_SIZE
+        ArrayContainerType* pArray_;   // ARRAY
+        MapContainerType* pMap_;       // MAP
     };
 
-    DataType type_;
+    /// ヒープを使わずに保持できる文字列の長さ
+    static const std::size_t INLINE_STR_SIZE = sizeof(Scalar);
+
+    // type_ 以外の値が有効かどうかは type_ によって決まる
     Scalar scalar_;
-    std::string str_;
-    std::vector<Variant*> array_;
-    std::map<Variant*, Variant*> map_;
+    std::uint32_t size_;   // STRING/BINARY/EXT length, TIMESTAMP nanoseconds
+    unsigned char type_;   // DataType
+    bool view_;            // STRING/BINARY/EXT refers to memory it does not own
+    signed char extType_;  // EXT type
+    VariantArena* pArena_;
 
     static Variant* pNullObject_;
 };
@@ -464,107 +907,178 @@ protected:
 // ========================================================================
 Variant* Variant::pNullObject_ = NULL;
 
-Variant::Variant(DataType dataType) : type_(dataType), scalar_(0), str_("") {
+Variant::Variant(DataType dataType) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
+    if (dataType == ARRAY) {
+        this->makeArray();
+    } else if (dataType == MAP) {
+        this->makeMap();
+    } else {
+        this->type_ = dataType;
+    }
+}
+
+Variant::Variant(VariantArena* pArena, DataType dataType)
+    : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(pArena) {
+    if (dataType == ARRAY) {
+        this->makeArray();
+    } else if (dataType == MAP) {
+        this->makeMap();
+    } else {
+        this->type_ = dataType;
+    }
 }
 
-Variant::Variant(const bool value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const bool value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const char value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const char value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const unsigned char value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const unsigned char value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const int value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const int value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const unsigned int value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const unsigned int value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const long value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const long value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const unsigned long value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const unsigned long value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const double value) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const double value) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(value);
 }
 
-Variant::Variant(const char* pStr) : type_(NONE), scalar_(0), str_("") {
-    this->set(std::string(pStr));
+Variant::Variant(const char* pStr) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
+    this->set(pStr);
 }
 
-Variant::Variant(const char* pStr, const std::size_t size) : type_(NONE), scalar_(0), str_("") {
-    this->set(std::string(pStr, size));
+Variant::Variant(const char* pStr, const std::size_t size) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
+    this->set(pStr, size);
 }
 
-Variant::Variant(const std::string& str) : type_(NONE), scalar_(0), str_("") {
+Variant::Variant(const std::string& str) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
     this->set(str);
 }
 
-Variant::Variant(const Variant& rhs) : type_(rhs.type_), scalar_(rhs.scalar_), str_(rhs.str_) {
-    this->copyChildren(rhs);
+Variant::Variant(const Variant& rhs) : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(NULL) {
+    this->copyFrom(rhs);
+}
+
+Variant::Variant(const Variant& rhs, VariantArena* pArena)
+    : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(pArena) {
+    this->copyFrom(rhs);
+}
+
+// the moved-to object belongs to the same arena as rhs
+Variant::Variant(Variant&& rhs) noexcept
+    : scalar_(0), size_(0), type_(NONE), view_(false), extType_(0), pArena_(rhs.pArena_) {
+    this->rawSwap(rhs);
 }
 
 Variant& Variant::operator=(const Variant& rhs) {
     if (this != &rhs) {
-        this->clearChildren();
+        // rhs may be a child of this; copy it before releasing the children.
+        Variant tmp(rhs, this->pArena_);
+        this->rawSwap(tmp);
+    }
+    return *this;
+}
 
-        this->type_ = rhs.type_;
-        this->scalar_ = rhs.scalar_;
-        this->str_ = rhs.str_;
-        this->copyChildren(rhs);
+Variant& Variant::operator=(Variant&& rhs) noexcept {
+    if (this != &rhs) {
+        // rhs may be a child of this; take it over before releasing the children.
+        if (this->pArena_ == rhs.pArena_) {
+            Variant tmp(std::move(rhs));
+            this->rawSwap(tmp);
+        } else {
+            Variant tmp(rhs, this->pArena_);
+            this->rawSwap(tmp);
+        }
     }
     return *this;
 }
 
+void Variant::swap(Variant& rhs) {
+    if (this->pArena_ == rhs.pArena_) {
+        this->rawSwap(rhs);
+    } else {
+        Variant tmp(std::move(*this));
+        *this = std::move(rhs);
+        rhs = std::move(tmp);
+    }
+}
+
+void Variant::rawSwap(Variant& rhs) noexcept {
+    assert(this->pArena_ == rhs.pArena_);
+    std::swap(this->scalar_, rhs.scalar_);
+    std::swap(this->size_, rhs.size_);
+    std::swap(this->type_, rhs.type_);
+    std::swap(this->view_, rhs.view_);
+    std::swap(this->extType_, rhs.extType_);
+}
+
+void Variant::reset(VariantArena* pArena) {
+    this->release();
+    this->pArena_ = pArena;
+}
+
+// nodes in an arena are not released one by one; the arena frees them at once.
 Variant::~Variant() {
-    this->clearChildren();
+    if (this->pArena_ == NULL) {
+        this->release();
+    }
 }
 
 // ========================================================================
 // vector operation
 // ========================================================================
 void Variant::resize(const std::size_t newSize) {
-    this->type_ = ARRAY;
-
-    const std::size_t oldSize = this->array_.size();
-    if (newSize < oldSize) {
-        // shrink
-        for (std::size_t i = newSize; i < oldSize; ++i) {
-            delete this->array_[i];
-            this->array_[i] = NULL;
-        }
-        this->array_.resize(newSize);
-    } else if (newSize > oldSize) {
-        // expand
-        this->array_.resize(newSize);
-        for (std::size_t i = oldSize; i < newSize; ++i) {
-            Variant* p = new Variant;
-            this->array_[i] = p;
-        }
-    }
+    this->makeArray();
+    this->array().resize(newSize);
+}
+
+void Variant::reserve(const std::size_t size) {
+    this->makeArray();
+    this->array().reserve(size);
 }
 
 void Variant::push_back(const Variant& value) {
-    this->type_ = ARRAY;
+    if (this->type_ == ARRAY) {
+        this->array().push_back(value);
+    } else {
+        // value may be owned by this
+        Variant tmp(value, this->pArena_);
+        this->makeArray();
+        this->array().push_back(std::move(tmp));
+    }
+}
 
-    Variant* pNew = new Variant(value);
-    this->array_.push_back(pNew);
+void Variant::push_back(Variant&& value) {
+    if (this->type_ == ARRAY) {
+        this->array().push_back(std::move(value));
+    } else {
+        // value may be owned by this
+        Variant tmp(std::move(value));
+        this->makeArray();
+        this->array().push_back(std::move(tmp));
+    }
 }
 
 const Variant& Variant::getAt(const std::size_t index) const {
-    if ((this->type_ == ARRAY) && (index < this->array_.size())) {
-        return *(this->array_[index]);
+    if ((this->type_ == ARRAY) && (index < this->array().size())) {
+        return this->array()[index];
     } else {
         return Variant::getNullObject();
     }
@@ -572,63 +1086,75 @@ const Variant& Variant::getAt(const std::size_t index) const {
 
 Variant& Variant::getAt(const std::size_t index) {
     assert(this->type_ == ARRAY);
-    if ((index +1) > this->array_.size()) {
+    if ((index +1) > this->array().size()) {
         this->resize(index +1);
     }
-    return *(this->array_[index]);
+    return this->array()[index];
 }
 
 void Variant::setAt(const std::size_t index, const Variant& value) {
-    this->type_ = ARRAY;
-    if ((index +1) > this->array_.size()) {
+    // value may be an element of this array
+    Variant tmp(value, this->pArena_);
+    this->setAt(index, std::move(tmp));
+}
+
+void Variant::setAt(const std::size_t index, Variant&& value) {
+    // take value first; resizing may move it
+    Variant tmp(std::move(value));
+    this->makeArray();
+    if ((index +1) > this->array().size()) {
         this->resize(index +1);
     }
-    *(this->array_[index]) = value;
+    this->array()[index] = std::move(tmp);
 }
 
 Variant::ArrayIterator Variant::beginArray() {
-    return ArrayIterator(this->array_.begin());
+    Variant* p = (this->type_ == ARRAY) ? this->array().data() : NULL;
+    return ArrayIterator(p);
 }
 
 Variant::ArrayIterator Variant::endArray() {
-    return ArrayIterator(this->array_.end());
+    Variant* p = (this->type_ == ARRAY) ? (this->array().data() + this->array().size()) : NULL;
+    return ArrayIterator(p);
 }
 
 Variant::ArrayConstIterator Variant::beginArray() const {
-    return ArrayConstIterator(this->array_.begin());
+    const Variant* p = (this->type_ == ARRAY) ? this->array().data() : NULL;
+    return ArrayConstIterator(p);
 }
 
 Variant::ArrayConstIterator Variant::endArray() const {
-    return ArrayConstIterator(this->array_.end());
+    const Variant* p = (this->type_ == ARRAY) ? (this->array().data() + this->array().size()) : NULL;
+    return ArrayConstIterator(p);
 }
 
 // ========================================================================
 // dict operation
 // ========================================================================
 void Variant::add(const Variant& key, const Variant& value) {
-    this->type_ = MAP;
-    Variant* pKey = new Variant(key);
-    Variant* pValue = new Variant(value);
-    this->map_[pKey] = pValue;
+    this->makeMap();
+    *(this->map().insert(key)->second) = value;
+}
+
+void Variant::add(Variant&& key, Variant&& value) {
+    this->makeMap();
+    *(this->map().insert(std::move(key))->second) = std::move(value);
 }
 
 Variant& Variant::operator[](const Variant& key) {
-    this->type_ = MAP;
-    MapContainerType::iterator p = this->find(key);
-    if (p != this->map_.end()) {
-        return *(p->second);
-    } else {
-        Variant* pKey = new Variant(key);
-        Variant* pValue = new Variant;
-        this->map_[pKey] = pValue;
-        return *(pValue);
-    }
+    this->makeMap();
+    return *(this->map().insert(key)->second);
+}
+
+Variant& Variant::operator[](Variant&& key) {
+    this->makeMap();
+    return *(this->map().insert(std::move(key))->second);
 }
 
 const Variant& Variant::operator[](const Variant& key) const {
     if (this->type() == MAP) {
-        MapContainerType::const_iterator p = this->find(key);
-        if (p != this->map_.end()) {
+        const VariantMapEntry* p = this->map().find(key);
+        if (p != NULL) {
             return *(p->second);
         }
     }
@@ -638,75 +1164,64 @@ const Variant& Variant::operator[](const Variant& key) const {
 bool Variant::has_key(const Variant& key) const {
     bool answer = false;
     if (this->type() == MAP) {
-        MapContainerType::const_iterator p = this->find(key);
-        if (p != this->map_.end()) {
+        if (this->map().find(key) != NULL) {
             answer = true;
         }
     }
     return answer;
 }
 
-Variant::MapContainerType::iterator Variant::find(const Variant& key) {
-    MapContainerType::iterator answer = this->map_.end();
-    if (this->map_.size() > 0) {
-        MapContainerType::iterator pEnd = this->map_.end();
-        for (MapContainerType::iterator p = this->map_.begin(); p != pEnd; ++p) {
-            const Variant tmp = *(p->first);
-            if (tmp == key) {
-                answer = p;
-                break;
-            }
-        }
-    }
-
-    return answer;
-}
-
-Variant::MapContainerType::const_iterator Variant::find(const Variant& key) const {
-    MapContainerType::const_iterator answer = this->map_.end();
-
-    MapContainerType::const_iterator pEnd = this->map_.end();
-    for (MapContainerType::const_iterator p = this->map_.begin(); p != pEnd; ++p) {
-        if (*(p->first) == key) {
-            answer = p;
-            break;
-        }
+void Variant::erase(const Variant& key) {
+    if (this->type_ != MAP) {
+        return;
     }
-    return answer;
-}
 
-void Variant::erase(const Variant& key) {
-    MapContainerType::iterator p = this->map_.begin();
-    MapContainerType::iterator pEnd = this->map_.end();
-    while (p != pEnd) {
-        if (*(p->first) == key) {
-            delete p->second;
-            p->second = NULL;
-
-            delete p->first;
-            this->map_.erase(p++);
-            break;
-        } else {
-            ++p;
-        }
+    VariantMapEntry* p = this->map().find(key);
+    if (p != NULL) {
+        this->map().erase(p);
     }
 }
 
 Variant::MapIterator Variant::beginMap() {
-    return MapIterator(this->map_.begin());
+    if (this->type_ != MAP) {
+        return MapIterator(NULL, NULL);
+    }
+    return MapIterator(this->map().begin(), this->map().end());
 }
 
 Variant::MapIterator Variant::endMap() {
-    return MapIterator(this->map_.end());
+    if (this->type_ != MAP) {
+        return MapIterator(NULL, NULL);
+    }
+    return MapIterator(this->map().end(), this->map().end());
 }
 
 Variant::MapConstIterator Variant::beginMap() const {
-    return MapConstIterator(this->map_.begin());
+    if (this->type_ != MAP) {
+        return MapConstIterator(NULL, NULL);
+    }
+    return MapConstIterator(this->map().begin(), this->map().end());
 }
 
 Variant::MapConstIterator Variant::endMap() const
 {
-    return MapConstIterator(this->map_.end());
+    if (this->type_ != MAP) {
+        return MapConstIterator(NULL, NULL);
+    }
+    return MapConstIterator(this->map().end(), this->map().end());
+}
+
+void Variant::sort_keys() {
+    if (this->type_ == ARRAY) {
+        for (ArrayContainerType::iterator p = this->array().begin(); p != this->array().end(); ++p) {
+            p->sort_keys();
+        }
+    } else if (this->type_ == MAP) {
+        this->map().sort();
+        for (VariantMapEntry* p = this->map().begin(); p != this->map().end(); ++p) {
+            p->second->sort_keys();
+        }
+    }
 }
 
 
@@ -723,7 +1238,7 @@ bool Variant::get_bool() const {
 
     case STRING:
         {
-            const std::string check = this->to_upper(this->str_);
+            const std::string check = this->to_upper(this->get_str());
             if ((check == "TRUE") ||
                 (check == "YES") ||
                 (check == "ON") ||
@@ -768,7 +1283,7 @@ int Variant::get_int() const {
         break;
 
     case STRING:
-        answer = std::atoi(this->str_.c_str());
+        answer = std::atoi(this->get_str().c_str());
         break;
 
     case INT:
@@ -791,6 +1306,10 @@ int Variant::get_int() const {
         answer = static_cast<int>(this->scalar_.double_);
         break;
 
+    case TIMESTAMP:
+        answer = static_cast<int>(this->scalar_.sec_);
+        break;
+
     default:
         break;
     }
@@ -806,7 +1325,7 @@ unsigned int Variant::get_uint() const {
         break;
 
     case STRING:
-        answer = std::atoi(this->str_.c_str());
+        answer = std::atoi(this->get_str().c_str());
         break;
 
     case INT:
@@ -829,6 +1348,10 @@ unsigned int Variant::get_uint() const {
         answer = static_cast<unsigned int>(this->scalar_.double_);
         break;
 
+    case TIMESTAMP:
+        answer = static_cast<unsigned int>(this->scalar_.sec_);
+        break;
+
     default:
         break;
     }
@@ -844,7 +1367,7 @@ long Variant::get_long() const {
         break;
 
     case STRING:
-        answer = std::atol(this->str_.c_str());
+        answer = std::atol(this->get_str().c_str());
         break;
 
     case INT:
@@ -867,6 +1390,10 @@ long Variant::get_long() const {
         answer = static_cast<long>(this->scalar_.double_);
         break;
 
+    case TIMESTAMP:
+        answer = static_cast<long>(this->scalar_.sec_);
+        break;
+
     default:
         break;
     }
@@ -882,7 +1409,7 @@ unsigned long Variant::get_ulong() const {
         break;
 
     case STRING:
-        answer = std::atol(this->str_.c_str());
+        answer = std::atol(this->get_str().c_str());
         break;
 
     case INT:
@@ -905,6 +1432,10 @@ unsigned long Variant::get_ulong() const {
         answer = static_cast<unsigned long>(this->scalar_.double_);
         break;
 
+    case TIMESTAMP:
+        answer = static_cast<unsigned long>(this->scalar_.sec_);
+        break;
+
     default:
         // do nothing
         break;
@@ -921,7 +1452,7 @@ double Variant::get_double() const {
         break;
 
     case STRING:
-        answer = std::atof(this->str_.c_str());
+        answer = std::atof(this->get_str().c_str());
         break;
 
     case INT:
@@ -944,6 +1475,10 @@ double Variant::get_double() const {
         answer = this->scalar_.double_;
         break;
 
+    case TIMESTAMP:
+        answer = static_cast<double>(this->scalar_.sec_) + static_cast<double>(this->size_) * 1e-9;
+        break;
+
     default:
         // do nothing
         break;
@@ -960,7 +1495,9 @@ std::string Variant::get_str() const {
         break;
 
     case STRING:
-        answer = this->str_;
+    case BINARY:
+    case EXT:
+        answer.assign(this->str_data(), this->size_);
         break;
 
     case INT:
@@ -983,6 +1520,15 @@ std::string Variant::get_str() const {
         answer = this->x2s(this->scalar_.double_);
         break;
 
+    case TIMESTAMP:
+        {
+            // seconds.nanoseconds; the nanoseconds are added to the (possibly negative) seconds
+            char nsec[16];
+            std::snprintf(nsec, sizeof(nsec), ".%09u", static_cast<unsigned int>(this->size_));
+            answer = this->x2s(this->scalar_.sec_) + nsec;
+        }
+        break;
+
     default:
         break;
     }
@@ -1015,8 +1561,19 @@ bool Variant::operator==(const Variant& rhs) const {
             answer = (std::fabs(this->scalar_.double_ - rhs.scalar_.double_) < std::numeric_limits<double>::epsilon());
             break;
 
+        case TIMESTAMP:
+            answer = ((this->scalar_.sec_ == rhs.scalar_.sec_) && (this->size_ == rhs.size_));
+            break;
+
+        case EXT:
+            if (this->extType_ != rhs.extType_) {
+                break;
+            }
+            // FALLTHROUGH
         case STRING:
-            answer = (this->str_ == rhs.str_);
+        case BINARY:
+            answer = ((this->size_ == rhs.size_) &&
+                      (std::memcmp(this->str_data(), rhs.str_data(), this->size_) == 0));
             break;
 
         case ARRAY:
@@ -1034,9 +1591,21 @@ bool Variant::operator==(const Variant& rhs) const {
 
         case MAP:
             if (this->size() == rhs.size()) {
-            }
-            break;
-
+                answer = true;
+                const VariantMapEntry* pEnd = this->map().end();
+                for (const VariantMapEntry* p = this->map().begin(); p != pEnd; ++p) {
+                    if (p->first == NULL) {
+                        continue;
+                    }
+                    const VariantMapEntry* q = rhs.map().find(*(p->first));
+                    if ((q == NULL) || (*(p->second) != *(q->second))) {
+                        answer = false;
+                        break;
+                    }
+                }
+            }
+            break;
+
         default:
             answer = true;
         }
@@ -1045,6 +1614,189 @@ bool Variant::operator==(const Variant& rhs) const {
     return answer;
 }
 
+std::size_t Variant::hash() const {
+    std::size_t seed = static_cast<std::size_t>(this->type());
+    switch (this->type()) {
+    case BOOLEAN:
+    case INT:
+        hashCombine(seed, std::hash<int>()(this->scalar_.int_));
+        break;
+
+    case UINT:
+        hashCombine(seed, std::hash<unsigned int>()(this->scalar_.uint_));
+        break;
+
+    case LONG:
+        hashCombine(seed, std::hash<long>()(this->scalar_.long_));
+        break;
+
+    case ULONG:
+        hashCombine(seed, std::hash<unsigned long>()(this->scalar_.ulong_));
+        break;
+
+    case DOUBLE:
+        // operator== compares with epsilon. Distinct doubles of magnitude
+        // 1 or more are at least epsilon apart, so large values can hash
+        // by value; values below 2 share one bucket to stay consistent.
+        if (std::fabs(this->scalar_.double_) >= 2.0) {
+            hashCombine(seed, std::hash<double>()(this->scalar_.double_));
+        }
+        break;
+
+    case TIMESTAMP:
+        hashCombine(seed, std::hash<std::int64_t>()(this->scalar_.sec_));
+        hashCombine(seed, this->size_);
+        break;
+
+    case EXT:
+        hashCombine(seed, static_cast<std::size_t>(this->extType_));
+        // FALLTHROUGH
+    case STRING:
+    case BINARY:
+        {
+            // FNV-1a
+            std::size_t h = 2166136261u;
+            const char* p = this->str_data();
+            for (std::size_t i = 0; i < this->size_; ++i) {
+                h = (h ^ static_cast<unsigned char>(p[i])) * 16777619u;
+            }
+            hashCombine(seed, h);
+        }
+        break;
+
+    case ARRAY:
+        for (ArrayContainerType::const_iterator p = this->array().begin(); p != this->array().end(); ++p) {
+            hashCombine(seed, p->hash());
+        }
+        break;
+
+    case MAP:
+        {
+            // independent of the iteration order
+            std::size_t sum = 0;
+            for (const VariantMapEntry* p = this->map().begin(); p != this->map().end(); ++p) {
+                if (p->first == NULL) {
+                    continue;
+                }
+                std::size_t item = p->hash;
+                hashCombine(item, p->second->hash());
+                sum += item;
+            }
+            hashCombine(seed, sum);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return seed;
+}
+
+int Variant::compare(const Variant& rhs) const {
+    if (this->type_ != rhs.type_) {
+        return (this->type_ < rhs.type_) ? -1 : 1;
+    }
+    if (this->operator==(rhs) == true) {
+        return 0;
+    }
+
+    switch (this->type()) {
+    case BOOLEAN:
+    case INT:
+        return (this->scalar_.int_ < rhs.scalar_.int_) ? -1 : 1;
+
+    case UINT:
+        return (this->scalar_.uint_ < rhs.scalar_.uint_) ? -1 : 1;
+
+    case LONG:
+        return (this->scalar_.long_ < rhs.scalar_.long_) ? -1 : 1;
+
+    case ULONG:
+        return (this->scalar_.ulong_ < rhs.scalar_.ulong_) ? -1 : 1;
+
+    case DOUBLE:
+        return (this->scalar_.double_ < rhs.scalar_.double_) ? -1 : 1;
+
+    case TIMESTAMP:
+        if (this->scalar_.sec_ != rhs.scalar_.sec_) {
+            return (this->scalar_.sec_ < rhs.scalar_.sec_) ? -1 : 1;
+        }
+        return (this->size_ < rhs.size_) ? -1 : 1;
+
+    case EXT:
+        if (this->extType_ != rhs.extType_) {
+            return (this->extType_ < rhs.extType_) ? -1 : 1;
+        }
+        // FALLTHROUGH
+    case STRING:
+    case BINARY:
+        {
+            const int c = std::memcmp(this->str_data(), rhs.str_data(), std::min(this->size_, rhs.size_));
+            if (c != 0) {
+                return c;
+            }
+            return (this->size_ < rhs.size_) ? -1 : 1;
+        }
+
+    case ARRAY:
+        {
+            const std::size_t size = std::min(this->size(), rhs.size());
+            for (std::size_t i = 0; i < size; ++i) {
+                const int c = this->getAt(i).compare(rhs.getAt(i));
+                if (c != 0) {
+                    return c;
+                }
+            }
+            return (this->size() < rhs.size()) ? -1 : 1;
+        }
+
+    case MAP:
+        {
+            if (this->size() != rhs.size()) {
+                return (this->size() < rhs.size()) ? -1 : 1;
+            }
+            // same size but not equal: compare in key order, since
+            // operator== does not depend on the insertion order
+            struct KeyLess {
+                bool operator()(const VariantMapEntry* lhs, const VariantMapEntry* rhs) const {
+                    return (lhs->first->compare(*(rhs->first)) < 0);
+                }
+            };
+            std::vector<const VariantMapEntry*> lhsEntries;
+            std::vector<const VariantMapEntry*> rhsEntries;
+            lhsEntries.reserve(this->size());
+            rhsEntries.reserve(rhs.size());
+            for (const VariantMapEntry* p = this->map().begin(); p != this->map().end(); ++p) {
+                if (p->first != NULL) {
+                    lhsEntries.push_back(p);
+                }
+            }
+            for (const VariantMapEntry* p = rhs.map().begin(); p != rhs.map().end(); ++p) {
+                if (p->first != NULL) {
+                    rhsEntries.push_back(p);
+                }
+            }
+            std::sort(lhsEntries.begin(), lhsEntries.end(), KeyLess());
+            std::sort(rhsEntries.begin(), rhsEntries.end(), KeyLess());
+
+            for (std::size_t i = 0; i < lhsEntries.size(); ++i) {
+                int c = lhsEntries[i]->first->compare(*(rhsEntries[i]->first));
+                if (c == 0) {
+                    c = lhsEntries[i]->second->compare(*(rhsEntries[i]->second));
+                }
+                if (c != 0) {
+                    return c;
+                }
+            }
+            return 0;
+        }
+
+    default:
+        return 0;
+    }
+}
+
 std::string Variant::str() const {
     std::string ans = "";
 
@@ -1088,56 +1840,134 @@ std::string Variant::str() const {
 
 
 void Variant::set(const bool value) {
+    this->release();
     this->type_ = BOOLEAN;
     this->scalar_.int_ = (value == true) ? 1 : 0;
 }
 
 void Variant::set(const char value) {
+    this->release();
     this->type_ = INT;
     this->scalar_.int_ = value;
 }
 
 void Variant::set(const unsigned char value) {
+    this->release();
     this->type_ = UINT;
     this->scalar_.uint_ = value;
 }
 
 void Variant::set(const int value) {
+    this->release();
     this->type_ = INT;
     this->scalar_.int_ = value;
 }
 
 void Variant::set(const unsigned int value) {
+    this->release();
     this->type_ = UINT;
     this->scalar_.uint_ = value;
 }
 
 void Variant::set(const long value) {
+    this->release();
     this->type_ = LONG;
     this->scalar_.long_ = value;
 }
 
 void Variant::set(const unsigned long value) {
+    this->release();
     this->type_ = ULONG;
     this->scalar_.ulong_ = value;
 }
 
 void Variant::set(const double value) {
+    this->release();
     this->type_ = DOUBLE;
     this->scalar_.double_ = value;
 }
 
 void Variant::set(const char* pStr) {
-    this->set(std::string(pStr));
+    this->setString(pStr, std::strlen(pStr));
 }
 
 void Variant::set(const char* pStr, const std::size_t size) {
-    this->set(std::string(pStr, size));
+    this->setString(pStr, size);
 }
 
 void Variant::set(const std::string& value) {
-    this->type_ = STRING;
-    this->str_ = value;
+    this->setString(value.data(), value.size());
+}
+
+const char* Variant::str_data() const {
+    const char* answer = NULL;
+    if (this->isBytes() == true) {
+        answer = (this->size_ <= INLINE_STR_SIZE) ? this->scalar_.inline_ : this->scalar_.pStr_;
+    }
+    return answer;
+}
+
+std::size_t Variant::str_size() const {
+    return (this->isBytes() == true) ? this->size_ : 0;
+}
+
+void Variant::set_binary(const char* pData, const std::size_t size, const bool view) {
+    if (view == true) {
+        this->setView(pData, size, BINARY, 0);
+    } else {
+        this->setString(pData, size, BINARY, 0);
+    }
+}
+
+void Variant::set_ext(const signed char extType, const char* pData, const std::size_t size, const bool view) {
+    if (view == true) {
+        this->setView(pData, size, EXT, extType);
+    } else {
+        this->setString(pData, size, EXT, extType);
+    }
+}
+
+void Variant::set_timestamp(const std::int64_t seconds, const std::uint32_t nanoseconds) {
+    assert(nanoseconds < 1000000000u);
+    this->release();
+    this->type_ = TIMESTAMP;
+    this->scalar_.sec_ = seconds;
+    this->size_ = nanoseconds;
+}
+
+void Variant::set_view(const char* pStr, const std::size_t size) {
+    this->setView(pStr, size, STRING, 0);
+}
+
+void Variant::detach() {
+    switch (this->type()) {
+    case STRING:
+    case BINARY:
+    case EXT:
+        if (this->view_ == true) {
+            this->setString(this->scalar_.pStr_, this->size_, this->type(), this->extType_);
+        }
+        break;
+
+    case ARRAY:
+        for (ArrayContainerType::iterator p = this->array().begin(); p != this->array().end(); ++p) {
+            p->detach();
+        }
+        break;
+
+    case MAP:
+        // detaching keeps the contents, so the hash of a key does not change
+        for (VariantMapEntry* p = this->map().begin(); p != this->map().end(); ++p) {
+            if (p->first != NULL) {
+                p->first->detach();
+                p->second->detach();
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
 }
 
 // ========================================================================
@@ -1152,52 +1982,162 @@ void Variant::merge(const Variant& rhs) {
     } else if (rhs.type() == MAP) {
         MapConstIterator pEnd = rhs.endMap();
         for (MapConstIterator p = rhs.beginMap(); p != pEnd; ++p) {
-            Variant key = p->first;
-            Variant value = p->second;
-            (*this)[key].merge(value);
+            (*this)[p->first].merge(p->second);
         }
     } else {
         this->operator=(rhs);
     }
 }
 
+void Variant::merge(Variant&& rhs) {
+    if (rhs.type() == ARRAY) {
+        for (ArrayContainerType::iterator p = rhs.array().begin(); p != rhs.array().end(); ++p) {
+            this->push_back(std::move(*p));
+        }
+        rhs.release();
+    } else if (rhs.type() == MAP) {
+        for (VariantMapEntry* p = rhs.map().begin(); p != rhs.map().end(); ++p) {
+            if (p->first != NULL) {
+                (*this)[std::move(*(p->first))].merge(std::move(*(p->second)));
+            }
+        }
+        rhs.release();
+    } else {
+        this->operator=(std::move(rhs));
+    }
+}
+
 
 // ========================================================================
 // protected
 // ========================================================================
-void Variant::clearChildren() {
-    for (ArrayContainerType::iterator p = this->array_.begin(); p != this->array_.end(); ++p) {
-        delete *p;
-        *p = NULL;
+void Variant::release() {
+    // memory taken from an arena is freed together with the arena
+    const DataType type = (this->pArena_ == NULL) ? this->type() : NONE;
+    switch (type) {
+    case STRING:
+    case BINARY:
+    case EXT:
+        if ((this->size_ > INLINE_STR_SIZE) && (this->view_ != true)) {
+            delete[] this->scalar_.pStr_;
+        }
+        break;
+
+    case ARRAY:
+        delete this->scalar_.pArray_;
+        break;
+
+    case MAP:
+        delete this->scalar_.pMap_;
+        break;
+
+    default:
+        break;
     }
-    this->array_.clear();
 
-    for (MapContainerType::iterator p = this->map_.begin(); p != this->map_.end(); ++p) {
-        delete p->first;
-        delete p->second;
-        p->second = NULL;
+    this->type_ = NONE;
+    this->view_ = false;
+    this->extType_ = 0;
+    this->size_ = 0;
+    this->scalar_.double_ = 0.0;
+}
+
+void Variant::copyFrom(const Variant& rhs) {
+    assert(this->type_ == NONE);
+    switch (rhs.type_) {
+    case STRING:
+    case BINARY:
+    case EXT:
+        this->setString(rhs.str_data(), rhs.size_, rhs.type(), rhs.extType_);
+        break;
+
+    case ARRAY:
+        this->makeArray();
+        this->array() = rhs.array();
+        break;
+
+    case MAP:
+        this->makeMap();
+        this->map().reserve(rhs.map().size());
+        for (const VariantMapEntry* p = rhs.map().begin(); p != rhs.map().end(); ++p) {
+            if (p->first != NULL) {
+                *(this->map().insert(*(p->first))->second) = *(p->second);
+            }
+        }
+        break;
+
+    default:
+        this->scalar_ = rhs.scalar_;
+        this->size_ = rhs.size_;
+        this->type_ = rhs.type_;
+        break;
     }
-    this->map_.clear();
 }
 
-void Variant::copyChildren(const Variant& rhs) {
-    assert(this->array_.size() == 0);
-    if (rhs.array_.empty() != true) {
-        this->array_.reserve(rhs.array_.size());
-        for (ArrayContainerType::const_iterator p = rhs.array_.begin(); p != rhs.array_.end(); ++p) {
-            Variant* pNew = new Variant(*(*p));
-            this->array_.push_back(pNew);
+void Variant::makeArray() {
+    if (this->type_ != ARRAY) {
+        this->release();
+        const VariantAllocator<Variant> allocator(this->pArena_);
+        if (this->pArena_ != NULL) {
+            void* p = this->pArena_->allocate(sizeof(ArrayContainerType), alignof(ArrayContainerType));
+            this->scalar_.pArray_ = ::new(p) ArrayContainerType(allocator);
+        } else {
+            this->scalar_.pArray_ = new ArrayContainerType(allocator);
         }
+        this->type_ = ARRAY;
     }
+}
 
-    assert(this->map_.size() == 0);
-    if (rhs.map_.empty() != true) {
-        for (MapContainerType::const_iterator p = rhs.map_.begin(); p != rhs.map_.end(); ++p) {
-            Variant* pKey = new Variant(*(p->first));
-            Variant* pValue = new Variant(*(p->second));
-            this->map_.insert(std::pair<Variant*, Variant*>(pKey, pValue));
+void Variant::makeMap() {
+    if (this->type_ != MAP) {
+        this->release();
+        if (this->pArena_ != NULL) {
+            void* p = this->pArena_->allocate(sizeof(MapContainerType), alignof(MapContainerType));
+            this->scalar_.pMap_ = ::new(p) MapContainerType(this->pArena_);
+        } else {
+            this->scalar_.pMap_ = new MapContainerType(NULL);
         }
+        this->type_ = MAP;
+    }
+}
+
+void Variant::setString(const char* pStr, const std::size_t size, const DataType type, const signed char extType) {
+    assert(size <= std::numeric_limits<std::uint32_t>::max());
+
+    // build aside: pStr may point into the current contents
+    Variant tmp(this->pArena_);
+    char* pDest = tmp.scalar_.inline_;
+    if (size > INLINE_STR_SIZE) {
+        pDest = (this->pArena_ != NULL)
+            ? static_cast<char*>(this->pArena_->allocate(size, 1))
+            : new char[size];
+        tmp.scalar_.pStr_ = pDest;
+    }
+    if (size > 0) {
+        std::memcpy(pDest, pStr, size);
+    }
+    tmp.size_ = static_cast<std::uint32_t>(size);
+    tmp.type_ = static_cast<unsigned char>(type);
+    tmp.extType_ = extType;
+
+    this->rawSwap(tmp);
+}
+
+void Variant::setView(const char* pStr, const std::size_t size, const DataType type, const signed char extType) {
+    assert(size <= std::numeric_limits<std::uint32_t>::max());
+    if (size <= INLINE_STR_SIZE) {
+        this->setString(pStr, size, type, extType);
+        return;
     }
+
+    Variant tmp(this->pArena_);
+    tmp.scalar_.pStr_ = const_cast<char*>(pStr);
+    tmp.size_ = static_cast<std::uint32_t>(size);
+    tmp.type_ = static_cast<unsigned char>(type);
+    tmp.view_ = true;
+    tmp.extType_ = extType;
+
+    this->rawSwap(tmp);
 }
 
 const Variant& Variant::getNullObject() {
@@ -1208,4 +2148,262 @@ const Variant& Variant::getNullObject() {
 }
 
 
+// ========================================================================
+// VariantConstructor<Variant>
+// ========================================================================
+void VariantConstructor<Variant>::construct(Variant* p, VariantArena* pArena, const Variant& rhs) {
+    ::new(static_cast<void*>(p)) Variant(rhs, pArena);
+}
+
+void VariantConstructor<Variant>::construct(Variant* p, VariantArena* pArena, Variant& rhs) {
+    ::new(static_cast<void*>(p)) Variant(rhs, pArena);
+}
+
+void VariantConstructor<Variant>::construct(Variant* p, VariantArena* pArena, Variant&& rhs) {
+    if (rhs.arena() == pArena) {
+        ::new(static_cast<void*>(p)) Variant(std::move(rhs));
+    } else {
+        ::new(static_cast<void*>(p)) Variant(rhs, pArena);
+    }
+}
+
+template <typename... Args>
+void VariantConstructor<Variant>::construct(Variant* p, VariantArena* pArena, Args&&... args) {
+    ::new(static_cast<void*>(p)) Variant(pArena);
+    *p = Variant(std::forward<Args>(args)...);
+}
+
+
+// ========================================================================
+// VariantMap
+// ========================================================================
+VariantMap::VariantMap(VariantArena* pArena)
+    : entries_(VariantAllocator<Entry>(pArena)), index_(VariantAllocator<std::uint32_t>(pArena)),
+      size_(0), pArena_(pArena) {
+}
+
+VariantMap::~VariantMap() {
+    for (Entry* p = this->begin(); p != this->end(); ++p) {
+        if (p->first != NULL) {
+            this->deleteNode(p->first);
+            this->deleteNode(p->second);
+        }
+    }
+}
+
+VariantMap::Entry* VariantMap::find(const Variant& key) {
+    return const_cast<Entry*>(static_cast<const VariantMap*>(this)->find(key));
+}
+
+const VariantMap::Entry* VariantMap::find(const Variant& key) const {
+    if (this->size_ == 0) {
+        return NULL;
+    }
+
+    bool found = false;
+    const std::size_t slot = this->lookup(key, key.hash(), found);
+    return (found == true) ? &(this->entries_[this->index_[slot] - 1]) : NULL;
+}
+
+VariantMap::Entry* VariantMap::insert(const Variant& key) {
+    return this->insertNode(key);
+}
+
+VariantMap::Entry* VariantMap::insert(Variant&& key) {
+    return this->insertNode(std::move(key));
+}
+
+template <typename Key>
+VariantMap::Entry* VariantMap::insertNode(Key&& key) {
+    // keep the load factor (deleted slots included) at 1/2 or less
+    if ((this->entries_.size() + 1) * 2 > this->index_.size()) {
+        this->rehash((this->size_ + 1) * 2);
+    }
+
+    const std::size_t hash = key.hash();
+    bool found = false;
+    const std::size_t slot = this->lookup(key, hash, found);
+    if (found == true) {
+        return &(this->entries_[this->index_[slot] - 1]);
+    }
+
+    Entry entry;
+    entry.first = this->newNode(std::forward<Key>(key));
+    entry.second = this->newNode();
+    entry.hash = hash;
+    this->entries_.push_back(entry);
+    this->index_[slot] = static_cast<std::uint32_t>(this->entries_.size());
+    ++(this->size_);
+    return &(this->entries_.back());
+}
+
+void VariantMap::erase(Entry* pEntry) {
+    const std::uint32_t position = static_cast<std::uint32_t>(pEntry - this->begin()) + 1;
+    const std::size_t mask = this->index_.size() - 1;
+    std::size_t slot = pEntry->hash & mask;
+    while (this->index_[slot] != position) {
+        slot = (slot + 1) & mask;
+    }
+    this->index_[slot] = DELETED;
+
+    this->deleteNode(pEntry->first);
+    this->deleteNode(pEntry->second);
+    pEntry->first = NULL;
+    pEntry->second = NULL;
+    --(this->size_);
+
+    // compact when more than half of the entries are deleted
+    if (this->size_ * 2 < this->entries_.size()) {
+        this->rehash(this->size_ * 2);
+    }
+}
+
+void VariantMap::reserve(const std::size_t size) {
+    this->entries_.reserve(size);
+    if (size * 2 > this->index_.size()) {
+        this->rehash(size * 2);
+    }
+}
+
+void VariantMap::sort() {
+    struct Deleted {
+        bool operator()(const Entry& entry) const {
+            return (entry.first == NULL);
+        }
+    };
+    struct Less {
+        bool operator()(const Entry& lhs, const Entry& rhs) const {
+            return (*(lhs.first) < *(rhs.first));
+        }
+    };
+    this->entries_.erase(std::remove_if(this->entries_.begin(), this->entries_.end(), Deleted()),
+                         this->entries_.end());
+    std::sort(this->entries_.begin(), this->entries_.end(), Less());
+
+    // the positions have changed: rebuild the index for the live entries
+    this->rehash(this->size_ * 2);
+}
+
+std::size_t VariantMap::lookup(const Variant& key, const std::size_t hash, bool& found) const {
+    const std::size_t mask = this->index_.size() - 1;
+    std::size_t slot = hash & mask;
+    std::size_t vacant = this->index_.size();
+    found = false;
+
+    while (this->index_[slot] != EMPTY) {
+        const std::uint32_t position = this->index_[slot];
+        if (position == DELETED) {
+            if (vacant == this->index_.size()) {
+                vacant = slot;
+            }
+        } else {
+            const Entry& entry = this->entries_[position - 1];
+            if ((entry.hash == hash) && (*(entry.first) == key)) {
+                found = true;
+                return slot;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return (vacant != this->index_.size()) ? vacant : slot;
+}
+
+void VariantMap::rehash(const std::size_t capacity) {
+    // drop deleted entries, keeping the order
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < this->entries_.size(); ++i) {
+        if (this->entries_[i].first != NULL) {
+            this->entries_[n++] = this->entries_[i];
+        }
+    }
+    this->entries_.resize(n);
+
+    std::size_t size = 8;
+    while (size < capacity) {
+        size *= 2;
+    }
+    this->index_.assign(size, EMPTY);
+
+    const std::size_t mask = size - 1;
+    for (std::size_t i = 0; i < n; ++i) {
+        std::size_t slot = this->entries_[i].hash & mask;
+        while (this->index_[slot] != EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+        this->index_[slot] = static_cast<std::uint32_t>(i + 1);
+    }
+}
+
+template <typename... Args>
+Variant* VariantMap::newNode(Args&&... args) {
+    void* p = (this->pArena_ != NULL)
+        ? this->pArena_->allocate(sizeof(Variant), alignof(Variant))
+        : ::operator new(sizeof(Variant));
+    VariantConstructor<Variant>::construct(static_cast<Variant*>(p), this->pArena_,
+                                           std::forward<Args>(args)...);
+    return static_cast<Variant*>(p);
+}
+
+void VariantMap::deleteNode(Variant* p) {
+    if (this->pArena_ == NULL) {
+        delete p;
+    }
+}
+
+
+// ========================================================================
+// VariantArena
+// ========================================================================
+VariantArena::VariantArena(const std::size_t blockSize)
+    : pInitial_(NULL), initialSize_(0), nextBlockSize_(blockSize), blockSize_(blockSize),
+      pCurrent_(NULL), pEnd_(NULL), pBlocks_(NULL) {
+}
+
+VariantArena::VariantArena(void* pBuffer, const std::size_t size, const std::size_t blockSize)
+    : pInitial_(pBuffer), initialSize_(size), nextBlockSize_(blockSize), blockSize_(blockSize),
+      pCurrent_(static_cast<char*>(pBuffer)), pEnd_(static_cast<char*>(pBuffer) + size),
+      pBlocks_(NULL) {
+}
+
+VariantArena::~VariantArena() {
+    this->release();
+}
+
+void* VariantArena::allocate(const std::size_t size, const std::size_t alignment) {
+    std::size_t space = static_cast<std::size_t>(this->pEnd_ - this->pCurrent_);
+    void* p = this->pCurrent_;
+    if ((this->pCurrent_ == NULL) || (std::align(alignment, size, p, space) == NULL)) {
+        // add a new block; blocks grow geometrically
+        const std::size_t header = sizeof(Block) + alignof(std::max_align_t);
+        const std::size_t blockSize = std::max(this->nextBlockSize_, size + alignment + header);
+        Block* pBlock = static_cast<Block*>(::operator new(blockSize));
+        pBlock->pNext = this->pBlocks_;
+        this->pBlocks_ = pBlock;
+        this->nextBlockSize_ = blockSize * 2;
+
+        this->pCurrent_ = reinterpret_cast<char*>(pBlock) + sizeof(Block);
+        this->pEnd_ = reinterpret_cast<char*>(pBlock) + blockSize;
+        space = static_cast<std::size_t>(this->pEnd_ - this->pCurrent_);
+        p = this->pCurrent_;
+        std::align(alignment, size, p, space);
+    }
+
+    this->pCurrent_ = static_cast<char*>(p) + size;
+    return p;
+}
+
+void VariantArena::release() {
+    while (this->pBlocks_ != NULL) {
+        Block* pNext = this->pBlocks_->pNext;
+        ::operator delete(this->pBlocks_);
+        this->pBlocks_ = pNext;
+    }
+
+    this->nextBlockSize_ = this->blockSize_;
+    this->pCurrent_ = static_cast<char*>(this->pInitial_);
+    this->pEnd_ = static_cast<char*>(this->pInitial_) + this->initialSize_;
+}
+
+
 #endif // VARIANT_H